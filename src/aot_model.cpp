@@ -0,0 +1,111 @@
+/*
+ * aot_model.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * Wrapper around AOTInductor compiled RVM models
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <torch/version.h>
+
+#if (TORCH_VERSION_MAJOR > 2) || ((TORCH_VERSION_MAJOR == 2) && (TORCH_VERSION_MINOR >= 6))
+#  define HAVE_AOTI_PACKAGE
+#  include <torch/csrc/inductor/aoti_package/model_package_loader.h>
+#endif
+
+#if (TORCH_VERSION_MAJOR > 2) || ((TORCH_VERSION_MAJOR == 2) && (TORCH_VERSION_MINOR >= 2))
+#  define HAVE_AOTI_RUNNER
+#  include <torch/csrc/inductor/aoti_runner/model_container_runner_cpu.h>
+#endif
+
+#include "aot_model.h"
+
+
+static bool
+hasSuffix(const char *s, const char *suffix)
+{
+	size_t ls = strlen(s);
+	size_t lx = strlen(suffix);
+	return (ls >= lx) && !strcmp(s + ls - lx, suffix);
+}
+
+AotModel::AotModel(const char *path) :
+	downsample_ratio(1.0),
+	rec_channels{16, 20, 40, 64}
+{
+	if (hasSuffix(path, ".pt2")) {
+#ifdef HAVE_AOTI_PACKAGE
+		auto loader = std::make_shared<torch::inductor::AOTIModelPackageLoader>(path);
+
+		this->run = [loader](std::vector<torch::Tensor> &inputs) {
+			return loader->run(inputs);
+		};
+
+		/* Model description from metadata */
+		auto md = loader->get_metadata();
+		auto it = md.find("rvm_downsample_ratio");
+		if (it != md.end())
+			this->downsample_ratio = std::stod(it->second);
+
+		it = md.find("rvm_rec_channels");
+		if (it != md.end()) {
+			if (sscanf(it->second.c_str(), "%d,%d,%d,%d",
+				&this->rec_channels[0], &this->rec_channels[1],
+				&this->rec_channels[2], &this->rec_channels[3]) != 4)
+				throw std::runtime_error("Invalid 'rvm_rec_channels' metadata in AOT package");
+		}
+#else
+		throw std::runtime_error("AOT packages (.pt2) require LibTorch >= 2.6");
+#endif
+	} else {
+#ifdef HAVE_AOTI_RUNNER
+		auto runner = std::make_shared<torch::inductor::AOTIModelContainerRunnerCpu>(path);
+
+		this->run = [runner](std::vector<torch::Tensor> &inputs) {
+			return runner->run(inputs);
+		};
+#else
+		throw std::runtime_error("AOT compiled models require LibTorch >= 2.2");
+#endif
+	}
+}
+
+std::vector<torch::Tensor>
+AotModel::forward(torch::Tensor src, const torch::Tensor *rn)
+{
+	std::vector<torch::Tensor> inputs;
+
+	inputs.push_back(src);
+
+	if (rn) {
+		for (int i=0; i<4; i++)
+			inputs.push_back(rn[i]);
+	} else {
+		/* Zero states, matching the size the model will produce */
+		int h = src.sizes()[2];
+		int w = src.sizes()[3];
+
+		if (this->downsample_ratio != 1.0) {
+			h = (int)floor(h * this->downsample_ratio);
+			w = (int)floor(w * this->downsample_ratio);
+		}
+
+		for (int i=0; i<4; i++) {
+			h = (h + 1) / 2;
+			w = (w + 1) / 2;
+			inputs.push_back(torch::zeros({1, this->rec_channels[i], h, w}, src.options()));
+		}
+	}
+
+	return this->run(inputs);
+}
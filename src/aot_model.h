@@ -0,0 +1,46 @@
+/*
+ * aot_model.h
+ *
+ * vim: ts=8 sw=8
+ *
+ * Wrapper around AOTInductor compiled RVM models
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include <torch/script.h>
+
+
+/*
+ * The compiled graph must have been exported from a wrapper taking
+ * (src, r1, r2, r3, r4) as tensors and returning the usual RVM list
+ * [fgr, pha, r1, r2, r3, r4]. The downsample ratio is baked in at export
+ * time. For the cold start, zero recurrent states are provided, which is
+ * what the model does internally when given None.
+ *
+ * Packages (.pt2) can carry metadata to describe the model :
+ *  - "rvm_downsample_ratio" : ratio used at export (default 1.0)
+ *  - "rvm_rec_channels"     : channels of r1..r4 (default "16,20,40,64",
+ *                             use "16,20,40,128" for resnet50)
+ */
+
+class AotModel {
+public:
+	AotModel(const char *path);
+
+	std::vector<torch::Tensor> forward(torch::Tensor src, const torch::Tensor *rn);
+
+	double downsampleRatio() const { return downsample_ratio; }
+
+private:
+	std::function<std::vector<torch::Tensor>(std::vector<torch::Tensor> &)> run;
+
+	double downsample_ratio;
+	int rec_channels[4];
+};
@@ -0,0 +1,168 @@
+/*
+ * backend.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * Inference backends abstraction
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+# define NOMINMAX
+# include <windows.h>
+#else
+# include <dlfcn.h>
+#endif
+
+#include "backend.h"
+#include "backend_module.h"
+
+
+Backend *backendCreateNative(const BackendConfig &cfg);
+
+
+/* ------------------------------------------------------------------------- */
+/* Modules                                                                   */
+/* ------------------------------------------------------------------------- */
+
+#ifdef _WIN32
+# define MODULE_SUFFIX	".dll"
+#else
+# define MODULE_SUFFIX	".so"
+#endif
+
+static const char *
+backendModuleName(enum backendType type)
+{
+	switch (type) {
+	case BACKEND_TORCHSCRIPT:
+	case BACKEND_TORCH_AOT:
+		return "rvmofx_torch";
+	case BACKEND_ONNXRUNTIME:
+		return "rvmofx_onnx";
+	default:
+		return NULL;
+	}
+}
+
+static std::string
+backendModuleDir()
+{
+	/* Modules live next to the binary containing this code (plugin or tool) */
+	std::string path;
+
+#ifdef _WIN32
+	HMODULE hm = NULL;
+	char buf[MAX_PATH];
+
+	if (GetModuleHandleExA(
+		GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+		(LPCSTR)&backendModuleDir, &hm) &&
+	    GetModuleFileNameA(hm, buf, sizeof(buf)))
+		path = buf;
+#else
+	Dl_info info;
+
+	if (dladdr((void *)&backendModuleDir, &info) && info.dli_fname)
+		path = info.dli_fname;
+#endif
+
+	size_t sep = path.find_last_of("/\\");
+	return (sep == std::string::npos) ? std::string() : path.substr(0, sep + 1);
+}
+
+static backendModuleCreateFn
+backendModuleLoad(const char *name)
+{
+	/* Modules are loaded once and never unloaded (LibTorch doesn't support it) */
+	static std::mutex lock;
+	static std::map<std::string, backendModuleCreateFn> modules;
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto it = modules.find(name);
+	if (it != modules.end())
+		return it->second;
+
+	std::string path = backendModuleDir() + name + MODULE_SUFFIX;
+	backendModuleCreateFn create;
+
+#ifdef _WIN32
+	/* Let the module find its own dependencies in its directory */
+	HMODULE h = LoadLibraryExA(path.c_str(), NULL, LOAD_WITH_ALTERED_SEARCH_PATH);
+	if (!h)
+		throw std::runtime_error("Unable to load backend module " + path);
+
+	create = (backendModuleCreateFn) GetProcAddress(h, BACKEND_MODULE_CREATE_SYM);
+#else
+	void *h = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!h)
+		throw std::runtime_error(std::string("Unable to load backend module: ") + dlerror());
+
+	create = (backendModuleCreateFn) dlsym(h, BACKEND_MODULE_CREATE_SYM);
+#endif
+
+	if (!create)
+		throw std::runtime_error("Invalid backend module " + path);
+
+	modules[name] = create;
+
+	return create;
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Public API                                                                */
+/* ------------------------------------------------------------------------- */
+
+Backend *
+backendCreate(enum backendType type, const BackendConfig &cfg)
+{
+	if (!backendAvailable(type))
+		throw std::runtime_error("Backend not available in this build");
+
+	/* Built-in */
+	if (type == BACKEND_NATIVE)
+		return backendCreateNative(cfg);
+
+	/* From module */
+	backendModuleCreateFn create = backendModuleLoad(backendModuleName(type));
+	char err[512] = "";
+
+	Backend *be = create(BACKEND_MODULE_API_VERSION, type, &cfg, err, sizeof(err));
+	if (!be)
+		throw std::runtime_error(err);
+
+	return be;
+}
+
+bool
+backendAvailable(enum backendType type)
+{
+	switch (type) {
+	case BACKEND_TORCHSCRIPT:
+	case BACKEND_TORCH_AOT:
+#ifdef RVMOFX_WITH_TORCH
+		return true;
+#else
+		return false;
+#endif
+	case BACKEND_ONNXRUNTIME:
+#ifdef RVMOFX_WITH_ONNXRUNTIME
+		return true;
+#else
+		return false;
+#endif
+	case BACKEND_NATIVE:
+		return true;
+	}
+
+	return false;
+}
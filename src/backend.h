@@ -0,0 +1,148 @@
+/*
+ * backend.h
+ *
+ * vim: ts=8 sw=8
+ *
+ * Inference backends abstraction
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+/* ------------------------------------------------------------------------- */
+/* Data                                                                      */
+/* ------------------------------------------------------------------------- */
+
+/* Planar float32 image (i.e. a 1xCxHxW tensor) living in host memory */
+struct PlanarImage {
+	int c, h, w;
+	std::vector<float> data;
+
+	PlanarImage() : c(0), h(0), w(0) {};
+	PlanarImage(int c, int h, int w) : c(c), h(h), w(w), data((size_t)c * h * w) {};
+
+	bool empty() const { return data.empty(); }
+
+	float *plane(int i) { return &data[(size_t)i * h * w]; }
+	const float *plane(int i) const { return &data[(size_t)i * h * w]; }
+};
+
+/* Opaque recurrent state, as produced by a given backend. They are never
+ * modified once returned, so they can be freely kept / shared */
+class BackendState {
+public:
+	virtual ~BackendState() {};
+
+	/* Memory it holds, in bytes (on whatever device) */
+	virtual size_t size() const = 0;
+};
+
+typedef std::shared_ptr<const BackendState> BackendStatePtr;
+
+
+/* ------------------------------------------------------------------------- */
+/* Backend                                                                   */
+/* ------------------------------------------------------------------------- */
+
+enum backendType {
+	BACKEND_TORCHSCRIPT,	/* LibTorch, TorchScript model */
+	BACKEND_TORCH_AOT,	/* LibTorch, AOTInductor compiled model */
+	BACKEND_ONNXRUNTIME,	/* ONNX Runtime, CPU execution provider */
+	BACKEND_NATIVE,		/* Built-in CPU engine (MobileNetV3 only) */
+};
+
+enum backendDevice {
+	BACKEND_DEVICE_CPU,
+	BACKEND_DEVICE_CUDA,
+};
+
+enum backendPrecision {
+	BACKEND_PRECISION_FLOAT16,
+	BACKEND_PRECISION_FLOAT32,
+};
+
+struct BackendConfig {
+	const char *model_file;
+	enum backendDevice device;
+	enum backendPrecision precision;
+};
+
+struct BackendForward {
+	/* Inputs */
+	const PlanarImage *src;		/* RGB */
+	double downsample_ratio;	/* 0.0 for model default */
+	BackendStatePtr state;		/* NULL for cold start */
+	bool want_fgr;			/* false if only alpha is used */
+	const std::atomic<bool> *cancel = nullptr;	/* optional, polled between model stages */
+	double feature_reuse = 0.0;	/* largest input change to reuse the last encoder pass (0.0 never, if supported) */
+
+	/* Outputs */
+	PlanarImage fgr;		/* RGB, same size as src (may be empty if !want_fgr) */
+	PlanarImage pha;		/* Alpha, same size as src */
+	BackendStatePtr next_state;
+	bool cancelled = false;		/* abandoned on request, other outputs are invalid */
+	bool features_reused = false;	/* encoder was skipped */
+};
+
+static inline bool
+backendCancelled(const std::atomic<bool> *cancel)
+{
+	return cancel && cancel->load(std::memory_order_relaxed);
+}
+
+/* Ratio a 'downsample_ratio' setting stands for. 0.0 is the RVM model
+ * default (1.0) on every backend, so switching backends doesn't change the
+ * result (inline since backend modules can't link back to the plugin) */
+static inline double
+backendDownsampleRatio(double downsample_ratio)
+{
+	return (downsample_ratio != 0.0) ? downsample_ratio : 1.0;
+}
+
+class Backend {
+public:
+	virtual ~Backend() {};
+
+	/* Run model on one frame. Throws on error. Can be called from any
+	 * thread, but only one at a time, unless concurrentForward() */
+	virtual void forward(BackendForward &fwd) = 0;
+
+	/* forward() can be called again while a cancelled call is still
+	 * winding down, so it doesn't have to be waited for */
+	virtual bool concurrentForward() const { return false; }
+
+	/* Prepare for frames of the given size (optional) */
+	virtual void warmup(int h, int w, double downsample_ratio) {};
+
+	/* Recurrent state to / from planar images (r1 .. r4), so it can be
+	 * remapped when the input geometry changes. Optional : returns false
+	 * or NULL if not supported */
+	virtual bool stateExport(PlanarImage rn[4], const BackendState &state) const { return false; }
+	virtual BackendStatePtr stateImport(const PlanarImage rn[4]) const { return BackendStatePtr(); }
+
+	/* Ratio the model really runs at on frames of the given size, when
+	 * asked for 'downsample_ratio' (0.0 for default). Some models have it
+	 * fixed at compile time and ignore the request */
+	virtual double downsampleRatio(int h, int w, double downsample_ratio) const {
+		return backendDownsampleRatio(downsample_ratio);
+	}
+	virtual bool downsampleRatioFixed() const { return false; }
+
+	/* What we're actually running on */
+	virtual enum backendDevice device() const = 0;
+	virtual enum backendPrecision precision() const = 0;
+};
+
+/* Create a backend and load its model. Throws on error */
+Backend *backendCreate(enum backendType type, const BackendConfig &cfg);
+
+/* Returns if a backend type was compiled in */
+bool backendAvailable(enum backendType type);
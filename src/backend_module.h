@@ -0,0 +1,40 @@
+/*
+ * backend_module.h
+ *
+ * vim: ts=8 sw=8
+ *
+ * Entry point of the dynamically loaded backend modules
+ *
+ * Heavy backends (LibTorch, ONNX Runtime) are built as separate modules
+ * only loaded when a model is first set up, so that just scanning the
+ * plugin doesn't pull in hundreds of MB of libraries.
+ *
+ * Modules may be built with a different libstdc++ ABI setting than the
+ * plugin (non-cxx11 LibTorch), so only what's in backend.h crosses the
+ * boundary : keep it free of std::string / std::list.
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include "backend.h"
+
+
+#define BACKEND_MODULE_API_VERSION	6
+#define BACKEND_MODULE_CREATE_SYM	"rvmofxBackendCreate"
+
+#ifdef _WIN32
+# define BACKEND_MODULE_EXPORT	extern "C" __declspec(dllexport)
+#else
+# define BACKEND_MODULE_EXPORT	extern "C" __attribute__((visibility("default")))
+#endif
+
+/* Create a backend of the given type. Exceptions don't cross the module
+ * boundary : returns NULL and the error message in 'err' on failure */
+typedef Backend *(*backendModuleCreateFn)(int api_version,
+	enum backendType type, const BackendConfig *cfg,
+	char *err, size_t err_len);
@@ -0,0 +1,734 @@
+/*
+ * backend_native.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * Native backend : self contained implementation of RVM MobileNetV3
+ * running on the CPU, with the weights read from the TorchScript model.
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+#include "mapped_file.h"
+#include "native_archive.h"
+#include "native_kernels.h"
+
+
+/*
+ * This mirrors MattingNetwork('mobilenetv3') from the RVM repository :
+ *
+ *  - backbone    : torchvision MobileNetV3-Large, last stage dilated
+ *  - aspp        : LR-ASPP
+ *  - decoder     : RecurrentDecoder with ConvGRU at each scale
+ *  - project_mat : 1x1 conv to fgr residual + alpha
+ *  - refiner     : DeepGuidedFilterRefiner (when downsampling)
+ *
+ * BatchNorm layers are applied as a per-channel scale and bias on the
+ * output of the preceding convolution, its weights are left untouched.
+ */
+
+/* torchvision MobileNetV3-Large inverted residual settings, as modified
+ * by RVM (dilation in the last stage) */
+static const struct {
+	int k, exp, out;
+	bool se, hs;
+	int stride, dilation;
+} mbv3Blocks[] = {
+	{ 3,  16,  16, false, false, 1, 1 },
+	{ 3,  64,  24, false, false, 2, 1 },	/* C1 */
+	{ 3,  72,  24, false, false, 1, 1 },
+	{ 5,  72,  40, true,  false, 2, 1 },	/* C2 */
+	{ 5, 120,  40, true,  false, 1, 1 },
+	{ 5, 120,  40, true,  false, 1, 1 },
+	{ 3, 240,  80, false, true,  2, 1 },	/* C3 */
+	{ 3, 200,  80, false, true,  1, 1 },
+	{ 3, 184,  80, false, true,  1, 1 },
+	{ 3, 184,  80, false, true,  1, 1 },
+	{ 3, 480, 112, true,  true,  1, 1 },
+	{ 3, 672, 112, true,  true,  1, 1 },
+	{ 5, 672, 160, true,  true,  2, 2 },	/* C4 */
+	{ 5, 960, 160, true,  true,  1, 2 },
+	{ 5, 960, 160, true,  true,  1, 2 },
+};
+
+#define MBV3_BLOCKS	(sizeof(mbv3Blocks) / sizeof(mbv3Blocks[0]))
+
+/* Recurrent state channels of the decoder (r1 .. r4) */
+static const int recChannels[4] = { 16, 20, 40, 64 };
+
+
+/* ------------------------------------------------------------------------- */
+/* Model                                                                     */
+/* ------------------------------------------------------------------------- */
+
+struct InvertedResidual {
+	bool has_expand;
+	NativeConv expand;
+	NativeConv dw;
+	bool has_se;
+	NativeConv se_fc1, se_fc2;
+	NativeConv project;
+	bool residual;
+};
+
+struct ConvGRU {
+	NativeConv ih;		/* -> r, z */
+	NativeConv hh;		/* -> c */
+};
+
+struct NativeModel {
+	/* Weights are used in place from there */
+	Archive archive;
+
+	/* Backbone */
+	NativeConv stem;
+	InvertedResidual blocks[MBV3_BLOCKS];
+	NativeConv last;
+
+	/* LR-ASPP */
+	NativeConv aspp1, aspp2;
+
+	/* Decoder */
+	ConvGRU gru4;
+	NativeConv dec_conv[3];		/* decode3 .. decode1 */
+	ConvGRU gru[3];
+	NativeConv dec0_conv1, dec0_conv2;
+
+	/* Heads */
+	NativeConv project_mat;
+	NativeConv box_filter;
+	NativeConv ref_conv1, ref_conv2, ref_conv3;
+};
+
+
+class ModelLoader {
+public:
+	ModelLoader(const Archive &archive) : tensors(archive.tensors) {};
+
+	void conv(NativeConv &conv, const std::string &name, const std::string &bn_name,
+		int stride, int pad, int dilation, int groups, enum nativeActivation act, double eps);
+
+private:
+	const ArchiveTensor &get(const std::string &name, size_t ndim);
+
+	const std::map<std::string, ArchiveTensor> &tensors;
+};
+
+const ArchiveTensor &
+ModelLoader::get(const std::string &name, size_t ndim)
+{
+	auto it = this->tensors.find(name);
+
+	if (it == this->tensors.end())
+		throw std::runtime_error("Missing weights for " + name + " (only RVM MobileNetV3 is supported)");
+
+	if (it->second.sizes.size() != ndim)
+		throw std::runtime_error("Unexpected shape for " + name);
+
+	return it->second;
+}
+
+void
+ModelLoader::conv(NativeConv &conv, const std::string &name, const std::string &bn_name,
+	int stride, int pad, int dilation, int groups, enum nativeActivation act, double eps)
+{
+	const ArchiveTensor &w = this->get(name + ".weight", 4);
+
+	conv.cout     = w.sizes[0];
+	conv.cin      = w.sizes[1] * groups;
+	conv.k        = w.sizes[2];
+	conv.stride   = stride;
+	conv.pad      = pad;
+	conv.dilation = dilation;
+	conv.groups   = groups;
+	conv.act      = act;
+
+	if ((w.sizes[2] != w.sizes[3]) || (conv.cout % groups))
+		throw std::runtime_error("Unexpected shape for " + name + ".weight");
+
+	conv.w = w.data();
+	conv.scale.assign(conv.cout, 1.0f);
+	conv.b.assign(conv.cout, 0.0f);
+
+	if (this->tensors.count(name + ".bias")) {
+		const ArchiveTensor &b = this->get(name + ".bias", 1);
+		if (b.sizes[0] != conv.cout)
+			throw std::runtime_error("Unexpected shape for " + name + ".bias");
+		conv.b.assign(b.data(), b.data() + conv.cout);
+	}
+
+	/* BatchNorm as output scale / bias, weights stay as in the file */
+	if (bn_name.empty())
+		return;
+
+	const float *gamma = this->get(bn_name + ".weight", 1).data();
+	const float *beta  = this->get(bn_name + ".bias", 1).data();
+	const float *mean  = this->get(bn_name + ".running_mean", 1).data();
+	const float *var   = this->get(bn_name + ".running_var", 1).data();
+
+	for (int o=0; o<conv.cout; o++) {
+		double scale = gamma[o] / sqrt((double)var[o] + eps);
+
+		conv.scale[o] = scale;
+		conv.b[o] = (conv.b[o] - mean[o]) * scale + beta[o];
+	}
+}
+
+static void
+modelLoad(NativeModel &m, const char *filename)
+{
+	archiveLoad(m.archive, filename);
+
+	ModelLoader ld(m.archive);
+	char pfx[64];
+
+	/* torchvision uses eps=1e-3 for the backbone, RVM the default 1e-5 */
+	const double eps_bb = 1e-3;
+	const double eps = 1e-5;
+
+	/* Backbone */
+	ld.conv(m.stem, "backbone.features.0.0", "backbone.features.0.1", 2, 1, 1, 1, ACT_HARDSWISH, eps_bb);
+
+	int cin = 16;
+
+	for (size_t i=0; i<MBV3_BLOCKS; i++)
+	{
+		InvertedResidual &b = m.blocks[i];
+		enum nativeActivation act = mbv3Blocks[i].hs ? ACT_HARDSWISH : ACT_RELU;
+		int k = mbv3Blocks[i].k;
+		int dil = mbv3Blocks[i].dilation;
+		int stride = (dil > 1) ? 1 : mbv3Blocks[i].stride;
+		int l = 0;
+
+		snprintf(pfx, sizeof(pfx), "backbone.features.%d.block.", (int)i + 1);
+		std::string p(pfx);
+
+		b.has_expand = (mbv3Blocks[i].exp != cin);
+		if (b.has_expand) {
+			ld.conv(b.expand, p + std::to_string(l) + ".0", p + std::to_string(l) + ".1", 1, 0, 1, 1, act, eps_bb);
+			l++;
+		}
+
+		ld.conv(b.dw, p + std::to_string(l) + ".0", p + std::to_string(l) + ".1",
+			stride, (k - 1) / 2 * dil, dil, mbv3Blocks[i].exp, act, eps_bb);
+		l++;
+
+		b.has_se = mbv3Blocks[i].se;
+		if (b.has_se) {
+			ld.conv(b.se_fc1, p + std::to_string(l) + ".fc1", "", 1, 0, 1, 1, ACT_RELU, 0.0);
+			ld.conv(b.se_fc2, p + std::to_string(l) + ".fc2", "", 1, 0, 1, 1, ACT_HARDSIGMOID, 0.0);
+			l++;
+		}
+
+		ld.conv(b.project, p + std::to_string(l) + ".0", p + std::to_string(l) + ".1", 1, 0, 1, 1, ACT_NONE, eps_bb);
+
+		b.residual = (mbv3Blocks[i].stride == 1) && (cin == mbv3Blocks[i].out);
+		cin = mbv3Blocks[i].out;
+	}
+
+	ld.conv(m.last, "backbone.features.16.0", "backbone.features.16.1", 1, 0, 1, 1, ACT_HARDSWISH, eps_bb);
+
+	/* LR-ASPP */
+	ld.conv(m.aspp1, "aspp.aspp1.0", "aspp.aspp1.1", 1, 0, 1, 1, ACT_RELU, eps);
+	ld.conv(m.aspp2, "aspp.aspp2.1", "", 1, 0, 1, 1, ACT_SIGMOID, 0.0);
+
+	/* Decoder */
+	ld.conv(m.gru4.ih, "decoder.decode4.gru.ih.0", "", 1, 1, 1, 1, ACT_SIGMOID, 0.0);
+	ld.conv(m.gru4.hh, "decoder.decode4.gru.hh.0", "", 1, 1, 1, 1, ACT_TANH, 0.0);
+
+	for (int i=0; i<3; i++) {
+		snprintf(pfx, sizeof(pfx), "decoder.decode%d.", 3 - i);
+		std::string p(pfx);
+
+		ld.conv(m.dec_conv[i], p + "conv.0", p + "conv.1", 1, 1, 1, 1, ACT_RELU, eps);
+		ld.conv(m.gru[i].ih, p + "gru.ih.0", "", 1, 1, 1, 1, ACT_SIGMOID, 0.0);
+		ld.conv(m.gru[i].hh, p + "gru.hh.0", "", 1, 1, 1, 1, ACT_TANH, 0.0);
+	}
+
+	ld.conv(m.dec0_conv1, "decoder.decode0.conv.0", "decoder.decode0.conv.1", 1, 1, 1, 1, ACT_RELU, eps);
+	ld.conv(m.dec0_conv2, "decoder.decode0.conv.3", "decoder.decode0.conv.4", 1, 1, 1, 1, ACT_RELU, eps);
+
+	/* Heads */
+	ld.conv(m.project_mat, "project_mat.conv", "", 1, 0, 1, 1, ACT_NONE, 0.0);
+
+	ld.conv(m.box_filter, "refiner.box_filter", "", 1, 1, 1, 4, ACT_NONE, 0.0);
+	ld.conv(m.ref_conv1, "refiner.conv.0", "refiner.conv.1", 1, 0, 1, 1, ACT_RELU, eps);
+	ld.conv(m.ref_conv2, "refiner.conv.3", "refiner.conv.4", 1, 0, 1, 1, ACT_RELU, eps);
+	ld.conv(m.ref_conv3, "refiner.conv.6", "", 1, 0, 1, 1, ACT_NONE, 0.0);
+
+	/* Sanity check a few shapes against what forward assumes */
+	if ((m.last.cout != 960) || (m.aspp1.cout != 128) ||
+	    (m.gru4.hh.cout != recChannels[3]) || (m.gru[0].hh.cout != recChannels[2]) ||
+	    (m.gru[1].hh.cout != recChannels[1]) || (m.gru[2].hh.cout != recChannels[0]) ||
+	    (m.project_mat.cout != 4) || (m.ref_conv3.cout != 4))
+		throw std::runtime_error("Unexpected model architecture (only RVM MobileNetV3 is supported)");
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Forward                                                                   */
+/* ------------------------------------------------------------------------- */
+
+static PlanarImage
+channelSlice(const PlanarImage &in, int c0, int n)
+{
+	PlanarImage out(n, in.h, in.w);
+	memcpy(out.data.data(), in.plane(c0), out.data.size() * sizeof(float));
+	return out;
+}
+
+static void
+invertedResidual(PlanarImage &x, const InvertedResidual &b)
+{
+	PlanarImage t, y;
+
+	if (b.has_expand) {
+		nativeConv(t, x, b.expand);
+		nativeConv(y, t, b.dw);
+	} else {
+		nativeConv(y, x, b.dw);
+	}
+
+	if (b.has_se) {
+		PlanarImage m, s1, s2;
+		nativeChannelMean(m, y);
+		nativeConv(s1, m, b.se_fc1);
+		nativeConv(s2, s1, b.se_fc2);
+
+		size_t hw = (size_t)y.h * y.w;
+		for (int c=0; c<y.c; c++) {
+			float *p = y.plane(c);
+			for (size_t i=0; i<hw; i++)
+				p[i] *= s2.data[c];
+		}
+	}
+
+	nativeConv(t, y, b.project);
+
+	if (b.residual)
+		for (size_t i=0; i<t.data.size(); i++)
+			t.data[i] += x.data[i];
+
+	x = std::move(t);
+}
+
+static void
+convGru(PlanarImage &x, PlanarImage &h, const ConvGRU &gru)
+{
+	PlanarImage xh, rz, c;
+	size_t n = x.data.size();
+
+	if (h.empty())
+		h = PlanarImage(x.c, x.h, x.w);
+
+	if ((h.c != x.c) || (h.h != x.h) || (h.w != x.w))
+		throw std::runtime_error("Recurrent state size mismatch");
+
+	/* r, z = ih(cat(x, h)) */
+	nativeConcat(xh, { &x, &h });
+	nativeConv(rz, xh, gru.ih);
+
+	/* c = hh(cat(x, r * h)) */
+	float *hr = xh.plane(x.c);
+	for (size_t i=0; i<n; i++)
+		hr[i] = rz.data[i] * h.data[i];
+
+	nativeConv(c, xh, gru.hh);
+
+	/* h = (1 - z) * h + z * c */
+	const float *z = rz.plane(x.c);
+	for (size_t i=0; i<n; i++)
+		h.data[i] = (1.0f - z[i]) * h.data[i] + z[i] * c.data[i];
+
+	x = h;
+}
+
+/* Upsample x2 and concatenate with the extra features, cropping to them */
+static void
+upsampleConcat(PlanarImage &out, const PlanarImage &x, const std::vector<const PlanarImage *> &extra)
+{
+	PlanarImage up;
+
+	nativeResize(up, x, x.h * 2, x.w * 2, 0.5, 0.5);
+
+	std::vector<const PlanarImage *> in { &up };
+	in.insert(in.end(), extra.begin(), extra.end());
+
+	nativeConcat(out, in);
+}
+
+/* Split x in two halves, run the GRU on the second one and concat back */
+static void
+splitGru(PlanarImage &x, PlanarImage &h, const ConvGRU &gru)
+{
+	int half = x.c / 2;
+	PlanarImage a = channelSlice(x, 0, half);
+	PlanarImage b = channelSlice(x, half, x.c - half);
+
+	convGru(b, h, gru);
+	nativeConcat(x, { &a, &b });
+}
+
+/* Image + its mean over channels (or only the mean if !color) */
+static PlanarImage
+guideImage(const PlanarImage &img, bool color=true)
+{
+	PlanarImage out(color ? 4 : 1, img.h, img.w);
+	size_t hw = (size_t)img.h * img.w;
+	float *m = out.plane(out.c - 1);
+
+	if (color)
+		memcpy(out.data.data(), img.data.data(), 3 * hw * sizeof(float));
+
+	for (size_t i=0; i<hw; i++)
+		m[i] = (img.data[i] + img.data[hw + i] + img.data[2*hw + i]) * (1.0f / 3.0f);
+
+	return out;
+}
+
+/* Encoder output (backbone + LR-ASPP) for a downsampled input */
+struct NativeFeatures {
+	PlanarImage src_sm;
+	PlanarImage f1, f2, f3, f4;
+};
+
+/* Mean absolute difference between two downsampled inputs */
+static double
+inputChange(const PlanarImage &a, const PlanarImage &b)
+{
+	double sum = 0.0;
+
+	if (a.empty() || (a.c != b.c) || (a.h != b.h) || (a.w != b.w))
+		return INFINITY;
+
+	for (size_t i=0; i<a.data.size(); i++)
+		sum += fabsf(a.data[i] - b.data[i]);
+
+	return sum / a.data.size();
+}
+
+/* Returns false if cancelled, leaving 'f' in an unknown state */
+static bool
+modelEncode(const NativeModel &m, const PlanarImage &src_sm, NativeFeatures &f,
+	const std::atomic<bool> *cancel)
+{
+	static const float mean[3] = { 0.485f, 0.456f, 0.406f };
+	static const float std[3]  = { 0.229f, 0.224f, 0.225f };
+
+	/* Backbone */
+	PlanarImage x(3, src_sm.h, src_sm.w);
+	size_t hw = (size_t)src_sm.h * src_sm.w;
+
+	for (int c=0; c<3; c++)
+		for (size_t i=0; i<hw; i++)
+			x.data[c*hw + i] = (src_sm.data[c*hw + i] - mean[c]) / std[c];
+
+	PlanarImage t;
+
+	nativeConv(t, x, m.stem);
+
+	for (size_t i=0; i<MBV3_BLOCKS; i++) {
+		if (backendCancelled(cancel))
+			return false;
+
+		invertedResidual(t, m.blocks[i]);
+		if (i == 0)  f.f1 = t;
+		if (i == 2)  f.f2 = t;
+		if (i == 5)  f.f3 = t;
+	}
+
+	nativeConv(x, t, m.last);
+
+	/* LR-ASPP */
+	PlanarImage a2, a2s;
+	nativeConv(f.f4, x, m.aspp1);
+	nativeChannelMean(a2, x);
+	nativeConv(a2s, a2, m.aspp2);
+
+	size_t hw4 = (size_t)f.f4.h * f.f4.w;
+	for (int c=0; c<f.f4.c; c++) {
+		float *p = f.f4.plane(c);
+		for (size_t i=0; i<hw4; i++)
+			p[i] *= a2s.data[c];
+	}
+
+	f.src_sm = src_sm;
+
+	return true;
+}
+
+/* Returns false if cancelled, leaving outputs and 'rn' in an unknown state.
+ * If 'feat' is given, the encoder pass it holds is reused when the input
+ * changed by at most 'reuse' since, and it's updated otherwise */
+static bool
+modelForward(const NativeModel &m, const PlanarImage &src, double ratio,
+	PlanarImage rn[4], PlanarImage *fgr, PlanarImage &pha,
+	NativeFeatures *feat, double reuse, bool &reused,
+	const std::atomic<bool> *cancel)
+{
+	/* Downsample */
+	PlanarImage src_sm;
+	bool downsample = (ratio != 1.0);
+
+	if (downsample)
+		nativeResize(src_sm, src, (int)floor(src.h * ratio), (int)floor(src.w * ratio), 1.0 / ratio, 1.0 / ratio);
+	else
+		src_sm = src;
+
+	/* Encoder, unless the last pass is still close enough. The change
+	 * is measured against the input of that pass, not the last frame,
+	 * so slow changes don't add up */
+	NativeFeatures local;
+	NativeFeatures &f = feat ? *feat : local;
+
+	reused = feat && (inputChange(f.src_sm, src_sm) <= reuse);
+
+	if (!reused && !modelEncode(m, src_sm, f, cancel)) {
+		f = NativeFeatures();
+		return false;
+	}
+
+	/* Decoder */
+	PlanarImage x, t;
+	PlanarImage s1, s2, s3;
+	nativeAvgPool2(s1, src_sm);
+	nativeAvgPool2(s2, s1);
+	nativeAvgPool2(s3, s2);
+
+	PlanarImage f4 = f.f4;		/* Updated in place */
+	splitGru(f4, rn[3], m.gru4);
+
+	const PlanarImage *feats[3] = { &f.f3, &f.f2, &f.f1 };
+	const PlanarImage *skips[3] = { &s3, &s2, &s1 };
+
+	x = std::move(f4);
+
+	for (int i=0; i<3; i++) {
+		if (backendCancelled(cancel))
+			return false;
+
+		upsampleConcat(t, x, { feats[i], skips[i] });
+		nativeConv(x, t, m.dec_conv[i]);
+		splitGru(x, rn[2-i], m.gru[i]);
+	}
+
+	PlanarImage hid;
+	upsampleConcat(t, x, { &src_sm });
+	nativeConv(x, t, m.dec0_conv1);
+	nativeConv(hid, x, m.dec0_conv2);
+
+	/* Projection : fgr residual (3) + alpha (1) */
+	PlanarImage y;
+	nativeConv(y, hid, m.project_mat);
+
+	if (backendCancelled(cancel))
+		return false;
+
+	/* Deep guided filter refiner */
+	if (downsample)
+	{
+		PlanarImage base_x = guideImage(src_sm);
+		PlanarImage &base_y = y;
+		PlanarImage xy = base_x, xx = base_x;
+		size_t n = base_x.data.size();
+
+		for (size_t i=0; i<n; i++) {
+			xy.data[i] *= base_y.data[i];
+			xx.data[i] *= base_x.data[i];
+		}
+
+		PlanarImage mean_x, mean_y, mean_xy, mean_xx;
+		nativeConv(mean_x,  base_x, m.box_filter);
+		nativeConv(mean_y,  base_y, m.box_filter);
+		nativeConv(mean_xy, xy,     m.box_filter);
+		nativeConv(mean_xx, xx,     m.box_filter);
+
+		/* cov_xy, var_x in place */
+		for (size_t i=0; i<n; i++) {
+			mean_xy.data[i] -= mean_x.data[i] * mean_y.data[i];
+			mean_xx.data[i] -= mean_x.data[i] * mean_x.data[i];
+		}
+
+		PlanarImage c, A, A_up, b_up;
+		nativeConcat(c, { &mean_xy, &mean_xx, &hid });
+		nativeConv(t, c, m.ref_conv1);
+		nativeConv(c, t, m.ref_conv2);
+		nativeConv(A, c, m.ref_conv3);
+
+		/* b = mean_y - A * mean_x (in mean_y) */
+		for (size_t i=0; i<n; i++)
+			mean_y.data[i] -= A.data[i] * mean_x.data[i];
+
+		/* Full resolution, only the alpha channel if that's all we need */
+		PlanarImage fine_x = guideImage(src, fgr != nullptr);
+
+		if (!fgr) {
+			A = channelSlice(A, 3, 1);
+			mean_y = channelSlice(mean_y, 3, 1);
+		}
+
+		nativeResize(A_up, A,      src.h, src.w, 0.0, 0.0);
+		nativeResize(b_up, mean_y, src.h, src.w, 0.0, 0.0);
+
+		for (size_t i=0; i<A_up.data.size(); i++)
+			A_up.data[i] = A_up.data[i] * fine_x.data[i] + b_up.data[i];
+
+		y = std::move(A_up);
+	}
+
+	/* Outputs (alpha is always the last channel of y) */
+	size_t hwo = (size_t)src.h * src.w;
+	const float *ya = y.plane(y.c - 1);
+
+	if (fgr) {
+		*fgr = PlanarImage(3, src.h, src.w);
+
+		for (size_t i=0; i<3*hwo; i++)
+			fgr->data[i] = std::min(std::max(y.data[i] + src.data[i], 0.0f), 1.0f);
+	}
+
+	pha = PlanarImage(1, src.h, src.w);
+
+	for (size_t i=0; i<hwo; i++)
+		pha.data[i] = std::min(std::max(ya[i], 0.0f), 1.0f);
+
+	return true;
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Backend                                                                   */
+/* ------------------------------------------------------------------------- */
+
+struct NativeState : public BackendState {
+	PlanarImage rn[4];
+
+	size_t size() const override {
+		size_t n = 0;
+		for (int i=0; i<4; i++)
+			n += this->rn[i].data.size() * sizeof(float);
+		return n;
+	}
+};
+
+
+class NativeBackend : public Backend {
+public:
+	NativeBackend(const BackendConfig &cfg);
+
+	void forward(BackendForward &fwd) override;
+
+	bool stateExport(PlanarImage rn[4], const BackendState &state) const override;
+	BackendStatePtr stateImport(const PlanarImage rn[4]) const override;
+
+	enum backendDevice device() const override { return BACKEND_DEVICE_CPU; }
+	enum backendPrecision precision() const override { return BACKEND_PRECISION_FLOAT32; }
+
+private:
+	std::shared_ptr<const NativeModel> model;
+	NativeFeatures features;	/* Last encoder pass, if reuse is enabled */
+};
+
+
+static std::shared_ptr<const NativeModel>
+modelGet(const char *filename)
+{
+	/* Models are immutable once loaded, all instances using the same
+	 * file (and content, a rewritten file is loaded again) share one as
+	 * long as any of them is alive */
+	static std::mutex lock;
+	static std::map<std::string, std::weak_ptr<const NativeModel>> models;
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::string key = mappedFileKey(filename);
+
+	std::shared_ptr<const NativeModel> model = models[key].lock();
+	if (model)
+		return model;
+
+	auto m = std::make_shared<NativeModel>();
+	modelLoad(*m, filename);
+
+	models[key] = m;
+
+	return m;
+}
+
+
+NativeBackend::NativeBackend(const BackendConfig &cfg)
+{
+	if (cfg.device != BACKEND_DEVICE_CPU)
+		throw std::runtime_error("Native backend only supports CPU");
+
+	/* Half precision weights are converted, compute is always float32 */
+	this->model = modelGet(cfg.model_file);
+}
+
+void
+NativeBackend::forward(BackendForward &fwd)
+{
+	const NativeState *state = static_cast<const NativeState *>(fwd.state.get());
+	auto next_state = std::make_shared<NativeState>();
+	double ratio = backendDownsampleRatio(fwd.downsample_ratio);
+
+	/* States are updated in place, so work on a copy */
+	if (state)
+		for (int i=0; i<4; i++)
+			next_state->rn[i] = state->rn[i];
+
+	if (fwd.feature_reuse <= 0.0)
+		this->features = NativeFeatures();
+
+	if (!modelForward(*this->model, *fwd.src, ratio, next_state->rn,
+			fwd.want_fgr ? &fwd.fgr : nullptr, fwd.pha,
+			(fwd.feature_reuse > 0.0) ? &this->features : nullptr,
+			fwd.feature_reuse, fwd.features_reused, fwd.cancel)) {
+		fwd.cancelled = true;
+		return;
+	}
+
+	fwd.next_state = next_state;
+}
+
+
+bool
+NativeBackend::stateExport(PlanarImage rn[4], const BackendState &state) const
+{
+	const NativeState &ns = static_cast<const NativeState &>(state);
+
+	for (int i=0; i<4; i++)
+		rn[i] = ns.rn[i];
+
+	return true;
+}
+
+BackendStatePtr
+NativeBackend::stateImport(const PlanarImage rn[4]) const
+{
+	auto state = std::make_shared<NativeState>();
+
+	for (int i=0; i<4; i++)
+		state->rn[i] = rn[i];
+
+	return state;
+}
+
+Backend *
+backendCreateNative(const BackendConfig &cfg)
+{
+	return new NativeBackend(cfg);
+}
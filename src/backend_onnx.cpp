@@ -0,0 +1,216 @@
+/*
+ * backend_onnx.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * ONNX Runtime backend (CPU execution provider)
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <onnxruntime_cxx_api.h>
+
+#include "backend.h"
+#include "backend_module.h"
+#include "mapped_file.h"
+
+
+/*
+ * This expects the ONNX export from the RVM repository :
+ *
+ *   inputs  : src, r1i, r2i, r3i, r4i, downsample_ratio
+ *   outputs : fgr, pha, r1o, r2o, r3o, r4o
+ *
+ * where the initial recurrent states can be given as [1,1,1,1] zeros
+ */
+
+static const char *inputNames[]  = { "src", "r1i", "r2i", "r3i", "r4i", "downsample_ratio" };
+static const char *outputNames[] = { "fgr", "pha", "r1o", "r2o", "r3o", "r4o" };
+
+
+struct OnnxState : public BackendState {
+	Ort::Value rn[4] { Ort::Value(nullptr), Ort::Value(nullptr), Ort::Value(nullptr), Ort::Value(nullptr) };
+
+	size_t size() const override {
+		size_t n = 0;
+		for (int i=0; i<4; i++)
+			if (this->rn[i])
+				n += this->rn[i].GetTensorTypeAndShapeInfo().GetElementCount() * sizeof(float);
+		return n;
+	}
+};
+
+
+class OnnxBackend : public Backend {
+public:
+	OnnxBackend(const BackendConfig &cfg);
+
+	void forward(BackendForward &fwd) override;
+
+	/* Session runs are thread safe, nothing else changes */
+	bool concurrentForward() const override { return true; }
+
+	bool stateExport(PlanarImage rn[4], const BackendState &state) const override;
+	BackendStatePtr stateImport(const PlanarImage rn[4]) const override;
+
+	enum backendDevice device() const override { return BACKEND_DEVICE_CPU; }
+	enum backendPrecision precision() const override { return BACKEND_PRECISION_FLOAT32; }
+
+private:
+	Ort::Session session;
+	Ort::MemoryInfo mem_info;
+};
+
+
+static Ort::Env &
+ortEnv()
+{
+	/* Only one environment per process */
+	static Ort::Env env(ORT_LOGGING_LEVEL_WARNING, "rvmofx");
+	return env;
+}
+
+static Ort::Value
+tensorView(Ort::MemoryInfo &mem_info, float *data, const std::vector<int64_t> &shape)
+{
+	size_t n = 1;
+	for (int64_t d : shape)
+		n *= d;
+
+	return Ort::Value::CreateTensor<float>(mem_info, data, n, shape.data(), shape.size());
+}
+
+static void
+valueToPlanar(PlanarImage &dst, const Ort::Value &v)
+{
+	auto shape = v.GetTensorTypeAndShapeInfo().GetShape();
+
+	dst = PlanarImage(shape[1], shape[2], shape[3]);
+	memcpy(dst.data.data(), v.GetTensorData<float>(), dst.data.size() * sizeof(float));
+}
+
+
+OnnxBackend::OnnxBackend(const BackendConfig &cfg) :
+	session(nullptr),
+	mem_info(Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault))
+{
+	if (cfg.device != BACKEND_DEVICE_CPU)
+		throw std::runtime_error("ONNX Runtime backend only supports CPU");
+
+	/* Session */
+	Ort::SessionOptions opts;
+	opts.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+
+	/* Parse straight from the mapped file, it's not needed past this */
+	MappedFile file(cfg.model_file);
+	this->session = Ort::Session(ortEnv(), file.data(), file.size(), opts);
+
+	/* We only deal with float32 models, there is no float16 on CPU */
+	if (this->session.GetInputTypeInfo(0).GetTensorTypeAndShapeInfo().GetElementType() != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT)
+		throw std::runtime_error("ONNX Runtime backend requires a float32 model");
+}
+
+void
+OnnxBackend::forward(BackendForward &fwd)
+{
+	const OnnxState *state = static_cast<const OnnxState *>(fwd.state.get());
+	std::vector<Ort::Value> inputs;
+	float zero = 0.0f;
+	float ratio = backendDownsampleRatio(fwd.downsample_ratio);
+
+	/* Source */
+	inputs.push_back(tensorView(this->mem_info,
+		(float *) fwd.src->data.data(),
+		{ 1, fwd.src->c, fwd.src->h, fwd.src->w }
+	));
+
+	/* Recurrent states (ONNX Runtime only reads them) */
+	for (int i=0; i<4; i++) {
+		if (state) {
+			const Ort::Value &rn = state->rn[i];
+			inputs.push_back(tensorView(this->mem_info,
+				(float *) rn.GetTensorData<float>(),
+				rn.GetTensorTypeAndShapeInfo().GetShape()
+			));
+		} else {
+			inputs.push_back(tensorView(this->mem_info, &zero, { 1, 1, 1, 1 }));
+		}
+	}
+
+	/* Ratio */
+	inputs.push_back(tensorView(this->mem_info, &ratio, { 1 }));
+
+	/* Run (without fetching fgr if not needed) */
+	int skip = fwd.want_fgr ? 0 : 1;
+
+	auto outputs = this->session.Run(
+		Ort::RunOptions{nullptr},
+		inputNames,  inputs.data(), inputs.size(),
+		outputNames + skip, 6 - skip
+	);
+
+	/* Recursive states for next run */
+	auto next_state = std::make_shared<OnnxState>();
+
+	for (int i=0; i<4; i++)
+		next_state->rn[i] = std::move(outputs[2+i-skip]);
+
+	fwd.next_state = next_state;
+
+	/* Outputs */
+	if (fwd.want_fgr)
+		valueToPlanar(fwd.fgr, outputs[0]);
+	valueToPlanar(fwd.pha, outputs[1-skip]);
+}
+
+
+bool
+OnnxBackend::stateExport(PlanarImage rn[4], const BackendState &state) const
+{
+	const OnnxState &os = static_cast<const OnnxState &>(state);
+
+	for (int i=0; i<4; i++)
+		valueToPlanar(rn[i], os.rn[i]);
+
+	return true;
+}
+
+BackendStatePtr
+OnnxBackend::stateImport(const PlanarImage rn[4]) const
+{
+	Ort::AllocatorWithDefaultOptions allocator;
+	auto state = std::make_shared<OnnxState>();
+
+	for (int i=0; i<4; i++) {
+		int64_t shape[4] = { 1, rn[i].c, rn[i].h, rn[i].w };
+
+		state->rn[i] = Ort::Value::CreateTensor<float>(allocator, shape, 4);
+		memcpy(state->rn[i].GetTensorMutableData<float>(), rn[i].data.data(), rn[i].data.size() * sizeof(float));
+	}
+
+	return state;
+}
+
+BACKEND_MODULE_EXPORT Backend *
+rvmofxBackendCreate(int api_version, enum backendType type, const BackendConfig *cfg, char *err, size_t err_len)
+{
+	if (api_version != BACKEND_MODULE_API_VERSION) {
+		snprintf(err, err_len, "Backend module API version mismatch");
+		return NULL;
+	}
+
+	try {
+		return new OnnxBackend(*cfg);
+	} catch (const std::exception& e) {
+		snprintf(err, err_len, "%s", e.what());
+		return NULL;
+	}
+}
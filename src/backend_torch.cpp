@@ -0,0 +1,997 @@
+/*
+ * backend_torch.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * LibTorch backend (TorchScript & AOTInductor models)
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <torch/script.h>
+#include <caffe2/serialize/read_adapter_interface.h>
+
+#include "aot_model.h"
+#include "backend.h"
+#include "backend_module.h"
+#include "mapped_file.h"
+
+
+/* Max number of warmed-up executors kept per model */
+#define EXECUTOR_CACHE_SIZE	4
+
+/* Max number of loaded modules kept in the process wide cache */
+#define MODULE_CACHE_SIZE	4
+
+/* Max number of requests run as one batch, and how long to wait for the
+ * others when instances are rendering concurrently */
+#define BATCH_MAX		8
+#define BATCH_WINDOW_US		2000
+
+
+struct TorchState : public BackendState {
+	torch::Tensor rn[4];
+
+	size_t size() const override {
+		size_t n = 0;
+		for (int i=0; i<4; i++)
+			if (this->rn[i].defined())
+				n += this->rn[i].nbytes();
+		return n;
+	}
+};
+
+
+/* Encoder output (backbone + LR-ASPP) for a downsampled input, staged
+ * models only */
+struct TorchFeatures {
+	torch::Tensor src_sm;
+	torch::Tensor f1, f2, f3, f4;
+};
+
+typedef std::shared_ptr<const TorchFeatures> TorchFeaturesPtr;
+
+
+/* Feeds the TorchScript loader from the mapped file, so the archive is
+ * read from the shared page cache rather than into private memory */
+class MappedReadAdapter : public caffe2::serialize::ReadAdapterInterface {
+public:
+	MappedReadAdapter(MappedFilePtr file) : file(file) {}
+
+	size_t size() const override {
+		return this->file->size();
+	}
+
+	size_t read(uint64_t pos, void *buf, size_t n, const char *what = "") const override {
+		if (pos >= this->file->size())
+			return 0;
+		n = std::min(n, (size_t)(this->file->size() - pos));
+		memcpy(buf, this->file->data() + pos, n);
+		return n;
+	}
+
+private:
+	MappedFilePtr file;
+};
+
+
+/*
+ * Process wide cache of loaded modules, converted to each target device /
+ * dtype. Only the converted modules are kept : the weights are copied out
+ * of the mapping on load, so keeping the module as stored in the file too
+ * would be one more private copy. Switching precision or device loads it
+ * again, from the page cache. Entries are keyed by the file size and mtime
+ * too : a model re-exported to the same path gets loaded again and the
+ * entries of the old one are dropped.
+ */
+struct CachedModule {
+	std::string file;
+	std::string key;
+	torch::Device dev;
+	torch::Dtype type;
+	uint64_t last_use;
+	torch::jit::script::Module module;
+};
+
+static torch::Dtype
+moduleDtype(const torch::jit::script::Module &module)
+{
+	for (const auto &p : module.parameters())
+		if (p.is_floating_point())
+			return p.scalar_type();
+	return torch::kFloat32;
+}
+
+static torch::jit::script::Module
+moduleLoad(const char *filename, torch::Device dev, torch::Dtype type)
+{
+	static std::mutex lock;
+	static std::vector<CachedModule> cache;
+	static uint64_t clock = 0;
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::string key = mappedFileKey(filename);
+
+	cache.erase(std::remove_if(cache.begin(), cache.end(),
+		[&](const CachedModule &e) {
+			return (e.file == filename) && (e.key != key);
+		}
+	), cache.end());
+
+	/* Already converted ? */
+	for (auto &e : cache) {
+		if ((e.key == key) && (e.dev == dev) && (e.type == type)) {
+			e.last_use = ++clock;
+			return e.module;
+		}
+	}
+
+	/* Load and convert in place, unless usable as is */
+	torch::jit::script::Module m = torch::jit::load(
+		std::make_shared<MappedReadAdapter>(std::make_shared<MappedFile>(filename)),
+		torch::Device(torch::kCPU)
+	);
+
+	if (!dev.is_cpu() || (moduleDtype(m) != type))
+		m.to(dev, type);
+
+	/* Evict least recently used one if full */
+	if (cache.size() >= MODULE_CACHE_SIZE) {
+		cache.erase(std::min_element(cache.begin(), cache.end(),
+			[](const CachedModule &a, const CachedModule &b) {
+				return a.last_use < b.last_use;
+			}
+		));
+	}
+
+	cache.push_back(CachedModule{ filename, key, dev, type, ++clock, m });
+
+	return m;
+}
+
+
+/*
+ * Requests of all instances using the same converted module go through a
+ * shared scheduler. Only one batch of a given kind (shape, ratio, variant
+ * and state shapes) runs at a time : requests coming in meanwhile queue up,
+ * and the next one to run takes along the queued ones of the same kind,
+ * their inputs and states being stacked on the batch dimension. Requests
+ * that couldn't be batched with any running one don't wait. When the last
+ * batch had several requests (i.e. instances are rendering concurrently),
+ * it also waits a little for the others.
+ */
+class TorchBackend;
+
+struct BatchRequest {
+	/* Inputs */
+	torch::Tensor src;		/* 1x3xHxW, on the device */
+	double downsample_ratio;
+	bool alpha_only;		/* Staged alpha only variant */
+	const TorchState *state;	/* NULL for cold start */
+	const std::atomic<bool> *cancel;
+	double feature_reuse;		/* See BackendForward */
+	TorchFeaturesPtr features;	/* Last encoder pass of the instance, if any */
+
+	/* Outputs */
+	std::vector<torch::Tensor> outputs;	/* Empty if cancelled */
+	TorchFeaturesPtr next_features;	/* Encoder pass to keep, if reuse is enabled */
+	bool features_reused = false;
+	std::exception_ptr error;
+	bool done = false;
+};
+
+class BatchScheduler {
+public:
+	void run(TorchBackend &be, BatchRequest &req);
+
+private:
+	static bool compatible(const BatchRequest &a, const BatchRequest &b);
+	static bool compatibleState(const TorchState *ref, const TorchState *state);
+	int pendingCompatible(const BatchRequest &req) const;
+	bool runningCompatible(const BatchRequest &req) const;
+
+	/* A batch being run : its first request and the state others must
+	 * match (which may be NULL, all cold starts) */
+	struct running_batch {
+		const BatchRequest *first;
+		const TorchState *ref;
+	};
+
+	std::mutex lock;
+	std::condition_variable cond;
+	std::vector<BatchRequest *> pending;
+	std::vector<running_batch> running;
+	int last_size = 1;
+};
+
+
+class TorchBackend : public Backend {
+public:
+	TorchBackend(const BackendConfig &cfg, bool aot);
+
+	void forward(BackendForward &fwd) override;
+	void warmup(int h, int w, double downsample_ratio) override;
+
+	bool stateExport(PlanarImage rn[4], const BackendState &state) const override;
+	BackendStatePtr stateImport(const PlanarImage rn[4]) const override;
+
+	/* AOT models are compiled with their ratio baked in */
+	double downsampleRatio(int h, int w, double downsample_ratio) const override {
+		if (this->aot)
+			return this->aot->downsampleRatio();
+		return backendDownsampleRatio(downsample_ratio);
+	}
+
+	bool downsampleRatioFixed() const override {
+		return (bool)this->aot;
+	}
+
+	/* TorchScript runs go through the batch scheduler */
+	bool concurrentForward() const override {
+		return !this->aot;
+	}
+
+	enum backendDevice device() const override {
+		return this->dev.is_cuda() ? BACKEND_DEVICE_CUDA : BACKEND_DEVICE_CPU;
+	}
+
+	enum backendPrecision precision() const override {
+		return (this->type == torch::kFloat16) ? BACKEND_PRECISION_FLOAT16 : BACKEND_PRECISION_FLOAT32;
+	}
+
+private:
+	torch::Device dev;
+	torch::Dtype type;
+
+	torch::jit::script::Module model;
+	std::unique_ptr<AotModel> aot;
+	bool staged;		/* Model stages can be run individually ... */
+	bool staged_alpha;	/* ... down to the refiner (alpha only path) */
+
+	/* Per-shape warmed-up executors (clones of 'model' sharing its weights) */
+	struct executor {
+		int h, w;
+		double downsample_ratio;
+		uint64_t last_use;
+		torch::jit::script::Module model;
+	};
+
+	std::mutex executors_lock;
+	std::vector<executor> executors;
+	uint64_t executor_clock;
+
+	torch::jit::script::Module getExecutor(int h, int w, double downsample_ratio);
+
+	/* Last encoder pass, if reuse is enabled. Cancelled runs can still be
+	 * winding down when the next one starts, hence the lock */
+	std::mutex features_lock;
+	TorchFeaturesPtr features;
+
+	/* Shared with all instances using the same module */
+	std::shared_ptr<BatchScheduler> scheduler;
+
+	void runBatch(const std::vector<BatchRequest *> &batch);
+
+	friend class BatchScheduler;
+};
+
+
+static torch::jit::Kwargs
+modelKwargs(double downsample_ratio)
+{
+	torch::jit::Kwargs kwargs;
+
+	if (downsample_ratio != 0.0) {
+		kwargs.insert({"downsample_ratio", downsample_ratio});
+	}
+
+	return kwargs;
+}
+
+/* MattingNetwork stages, so the model can be run one stage at a time */
+static bool
+modelHasStages(const torch::jit::script::Module &model)
+{
+	static const char *stages[] = { "backbone", "aspp", "decoder", "project_mat", "refiner" };
+
+	for (const char *s : stages)
+		if (!model.hasattr(s))
+			return false;
+
+	return model.find_method("_interpolate").has_value();
+}
+
+/* And the deep guided filter refiner internals, for the alpha only path */
+static bool
+modelHasAlphaStages(const torch::jit::script::Module &model)
+{
+	if (!modelHasStages(model))
+		return false;
+
+	torch::jit::script::Module refiner = model.attr("refiner").toModule();
+
+	return refiner.hasattr("box_filter") && refiner.hasattr("conv");
+}
+
+static std::vector<torch::Tensor>
+ivalueTensors(const c10::IValue &v)
+{
+	if (!v.isTuple())
+		return v.toTensorVector();
+
+	std::vector<torch::Tensor> t;
+	for (const auto &e : v.toTuple()->elements())
+		t.push_back(e.toTensor());
+	return t;
+}
+
+/* Largest mean absolute difference between the downsampled inputs of the
+ * two batches, over their items */
+static double
+inputChange(torch::Tensor a, torch::Tensor b)
+{
+	if (!a.defined() || (a.sizes() != b.sizes()))
+		return std::numeric_limits<double>::infinity();
+
+	return (a - b).abs().to(torch::kFloat32).mean({1, 2, 3}).max().item<double>();
+}
+
+/*
+ * Same as MattingNetwork.forward, but running each stage separately so the
+ * run can be abandoned between two stages (returns nothing then). With
+ * 'alpha_only', past the (low resolution) projection, only the alpha channel
+ * goes through the upsampling and full resolution refinement, and the
+ * foreground output is left undefined.
+ * If 'feat' is given, the encoder pass it holds is reused when the input
+ * changed by at most 'reuse' since, and it's updated otherwise.
+ */
+static std::vector<torch::Tensor>
+modelForwardStaged(torch::jit::script::Module &model, torch::Tensor src,
+	double downsample_ratio, const torch::Tensor *state, bool alpha_only,
+	TorchFeatures *feat, double reuse, bool &reused,
+	const std::function<bool()> &cancelled)
+{
+	double ratio = (downsample_ratio != 0.0) ? downsample_ratio : 1.0;
+	c10::IValue rn[4];
+
+	if (state)
+		for (int i=0; i<4; i++)
+			rn[i] = state[i];
+
+	/* Low resolution */
+	torch::Tensor src_sm = (ratio != 1.0) ?
+		model.run_method("_interpolate", src, ratio).toTensor() :
+		src;
+
+	/* Encoder, unless the last pass is still close enough. The change
+	 * is measured against the input of that pass, not the last frame,
+	 * so slow changes don't add up */
+	TorchFeatures local;
+	TorchFeatures &f = feat ? *feat : local;
+
+	reused = feat && (inputChange(f.src_sm, src_sm) <= reuse);
+
+	if (!reused) {
+		std::vector<torch::Tensor> b = ivalueTensors(model.attr("backbone").toModule().forward({ src_sm }));
+		if (cancelled())
+			return {};
+
+		f.f1 = b[0];
+		f.f2 = b[1];
+		f.f3 = b[2];
+		f.f4 = model.attr("aspp").toModule().forward({ b[3] }).toTensor();
+		f.src_sm = src_sm;
+		if (cancelled())
+			return {};
+	}
+
+	std::vector<torch::Tensor> dec = ivalueTensors(model.attr("decoder").toModule().forward({
+		src_sm, f.f1, f.f2, f.f3, f.f4, rn[0], rn[1], rn[2], rn[3]
+	}));
+	torch::Tensor hid = dec[0];
+
+	torch::Tensor y = model.attr("project_mat").toModule().forward({ hid }).toTensor();
+	torch::Tensor fgr, pha;
+
+	if (cancelled())
+		return {};
+
+	if ((ratio != 1.0) && alpha_only) {
+		/* Deep guided filter refiner */
+		torch::jit::script::Module refiner = model.attr("refiner").toModule();
+		torch::jit::script::Module box = refiner.attr("box_filter").toModule();
+		torch::jit::script::Module conv = refiner.attr("conv").toModule();
+
+		torch::Tensor base_x = torch::cat({ src_sm, src_sm.mean(1, true) }, 1);
+		torch::Tensor mean_x = box.forward({ base_x }).toTensor();
+		torch::Tensor mean_y = box.forward({ y }).toTensor();
+		torch::Tensor cov_xy = box.forward({ base_x * y }).toTensor() - mean_x * mean_y;
+		torch::Tensor var_x  = box.forward({ base_x * base_x }).toTensor() - mean_x * mean_x;
+
+		torch::Tensor A = conv.forward({ torch::cat({ cov_xy, var_x, hid }, 1) }).toTensor();
+		torch::Tensor b = mean_y - A * mean_x;
+
+		/* Full resolution, alpha only */
+		int64_t size[2] = { src.size(2), src.size(3) };
+
+		A = torch::upsample_bilinear2d(A.narrow(1, 3, 1), size, false);
+		b = torch::upsample_bilinear2d(b.narrow(1, 3, 1), size, false);
+
+		pha = A * src.mean(1, true) + b;
+	} else if (ratio != 1.0) {
+		/* Whole refiner, on the foreground residual and alpha */
+		std::vector<torch::Tensor> r = ivalueTensors(model.attr("refiner").toModule().forward({
+			src, src_sm, y.narrow(1, 0, 3), y.narrow(1, 3, 1), hid
+		}));
+		fgr = r[0];
+		pha = r[1];
+	} else {
+		if (!alpha_only)
+			fgr = y.narrow(1, 0, 3);
+		pha = y.narrow(1, 3, 1);
+	}
+
+	if (fgr.defined())
+		fgr = (fgr + src).clamp(0.0, 1.0);
+
+	return { fgr, pha.clamp(0.0, 1.0), dec[1], dec[2], dec[3], dec[4] };
+}
+
+/* Full model, staged if possible. The states are optional (cold start).
+ * Returns nothing if cancelled, which is only checked between stages.
+ * Encoder passes can only be reused when staged */
+static std::vector<torch::Tensor>
+modelForward(torch::jit::script::Module &model, bool staged, torch::Tensor src,
+	double downsample_ratio, const torch::Tensor *state, bool alpha_only,
+	TorchFeatures *feat, double reuse, bool &reused,
+	const std::function<bool()> &cancelled)
+{
+	reused = false;
+
+	if (staged)
+		return modelForwardStaged(model, src, downsample_ratio, state, alpha_only,
+			feat, reuse, reused, cancelled);
+
+	if (state)
+		return model.forward({
+			src,
+			state[0],
+			state[1],
+			state[2],
+			state[3]
+		}, modelKwargs(downsample_ratio)).toTensorList().vec();
+
+	return model.forward({
+		src
+	}, modelKwargs(downsample_ratio)).toTensorList().vec();
+}
+
+static void
+modelWarmup(torch::jit::script::Module &model, bool staged, torch::Tensor src, double downsample_ratio)
+{
+	auto never = []() { return false; };
+	bool reused;
+
+	/* Both call variants are used by forward: cold start and with
+	 * recursive states. Run each once so the executor has both compiled
+	 * and all allocations / kernel selections for this shape are done */
+	std::vector<torch::Tensor> outputs = modelForward(model, staged, src,
+		downsample_ratio, NULL, false, NULL, 0.0, reused, never);
+
+	modelForward(model, staged, src,
+		downsample_ratio, &outputs[2], false, NULL, 0.0, reused, never);
+}
+
+static void
+tensorToPlanar(PlanarImage &dst, torch::Tensor t)
+{
+	dst = PlanarImage(t.sizes()[1], t.sizes()[2], t.sizes()[3]);
+
+	torch::from_blob(dst.data.data(), {1, dst.c, dst.h, dst.w}, torch::kFloat32).copy_(t);
+}
+
+
+static std::shared_ptr<BatchScheduler>
+batchSchedulerGet(const char *filename, torch::Device dev, torch::Dtype type)
+{
+	/* One per converted module (same file path, size and modification time),
+	 * as long as any instance uses it */
+	static std::mutex lock;
+	static std::map<std::string, std::weak_ptr<BatchScheduler>> schedulers;
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::string key = mappedFileKey(filename) + "|" + dev.str() + "|" + std::to_string((int)type);
+
+	std::shared_ptr<BatchScheduler> s = schedulers[key].lock();
+	if (s)
+		return s;
+
+	s = std::make_shared<BatchScheduler>();
+	schedulers[key] = s;
+
+	return s;
+}
+
+bool
+BatchScheduler::compatible(const BatchRequest &a, const BatchRequest &b)
+{
+	return  (a.src.sizes() == b.src.sizes()) &&
+		(a.downsample_ratio == b.downsample_ratio) &&
+		(a.alpha_only == b.alpha_only);
+}
+
+bool
+BatchScheduler::compatibleState(const TorchState *ref, const TorchState *state)
+{
+	/* States can come from a different geometry (remapped). Cold starts
+	 * get zeros shaped like the reference, the batch first state */
+	if (ref && state)
+		for (int i=0; i<4; i++)
+			if (ref->rn[i].sizes() != state->rn[i].sizes())
+				return false;
+
+	return true;
+}
+
+int
+BatchScheduler::pendingCompatible(const BatchRequest &req) const
+{
+	const TorchState *ref = req.state;
+	int n = 0;
+
+	for (const BatchRequest *r : this->pending) {
+		if (compatible(req, *r) && compatibleState(ref, r->state)) {
+			if (!ref)
+				ref = r->state;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+bool
+BatchScheduler::runningCompatible(const BatchRequest &req) const
+{
+	for (const running_batch &b : this->running)
+		if (compatible(*b.first, req) && compatibleState(b.ref, req.state))
+			return true;
+
+	return false;
+}
+
+void
+BatchScheduler::run(TorchBackend &be, BatchRequest &req)
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+
+	this->pending.push_back(&req);
+	this->cond.notify_all();
+
+	/* Wait for the running batch it could have been part of, unless we
+	 * got picked up by another batch */
+	this->cond.wait(lk, [&] { return req.done || !this->runningCompatible(req); });
+
+	if (!req.done)
+	{
+		/* From now on, whatever would batch with us waits for us */
+		this->running.push_back({ &req, req.state });
+
+		/* Others were there last time, give them a chance to join */
+		if (this->last_size > 1)
+			this->cond.wait_for(lk, std::chrono::microseconds(BATCH_WINDOW_US), [&] {
+				return this->pendingCompatible(req) >= std::min(this->last_size, BATCH_MAX);
+			});
+
+		/* Ours first, then whatever matches, oldest first. States must
+		 * match the first one taken */
+		std::vector<BatchRequest *> batch { &req };
+		const TorchState *ref = req.state;
+
+		this->pending.erase(std::find(this->pending.begin(), this->pending.end(), &req));
+
+		for (auto it = this->pending.begin(); (it != this->pending.end()) && ((int)batch.size() < BATCH_MAX); ) {
+			if (compatible(req, **it) && compatibleState(ref, (*it)->state)) {
+				if (!ref)
+					ref = (*it)->state;
+				batch.push_back(*it);
+				it = this->pending.erase(it);
+			} else {
+				it++;
+			}
+		}
+
+		this->last_size = batch.size();
+
+		auto self = std::find_if(this->running.begin(), this->running.end(),
+			[&](const running_batch &b) { return b.first == &req; });
+
+		self->ref = ref;
+
+		lk.unlock();
+
+		try {
+			be.runBatch(batch);
+		} catch (...) {
+			std::exception_ptr e = std::current_exception();
+			for (BatchRequest *r : batch)
+				r->error = e;
+		}
+
+		lk.lock();
+
+		for (BatchRequest *r : batch)
+			r->done = true;
+
+		this->running.erase(std::find_if(this->running.begin(), this->running.end(),
+			[&](const running_batch &b) { return b.first == &req; }));
+
+		this->cond.notify_all();
+	}
+
+	lk.unlock();
+
+	if (req.error)
+		std::rethrow_exception(req.error);
+}
+
+
+TorchBackend::TorchBackend(const BackendConfig &cfg, bool aot) :
+	dev(torch::kCPU),
+	type(torch::kFloat32),
+	staged(false),
+	staged_alpha(false),
+	executor_clock(0)
+{
+	/* Target device and type from config */
+	switch (cfg.device) {
+	case BACKEND_DEVICE_CPU:
+		this->dev = torch::Device(torch::kCPU);
+		break;
+	case BACKEND_DEVICE_CUDA:
+		this->dev = torch::Device(torch::kCUDA);
+		break;
+	}
+
+	switch (cfg.precision) {
+	case BACKEND_PRECISION_FLOAT16:
+		this->type = torch::kFloat16;
+		break;
+	case BACKEND_PRECISION_FLOAT32:
+		this->type = torch::kFloat32;
+		break;
+	}
+
+	/* Load model */
+	if (aot) {
+		/* AOT compiled, device and precision are fixed at build */
+		this->aot.reset(new AotModel(cfg.model_file));
+	} else {
+		/* Any precision file works, weights are converted to the target */
+		this->model = moduleLoad(cfg.model_file, this->dev, this->type);
+		torch::jit::getProfilingMode() = false;
+		this->staged = modelHasStages(this->model);
+		this->staged_alpha = modelHasAlphaStages(this->model);
+		this->scheduler = batchSchedulerGet(cfg.model_file, this->dev, this->type);
+	}
+}
+
+torch::jit::script::Module
+TorchBackend::getExecutor(int h, int w, double downsample_ratio)
+{
+	std::lock_guard<std::mutex> guard(this->executors_lock);
+
+	/* Already have one for that shape ? */
+	for (auto &e : this->executors) {
+		if ((e.h == h) && (e.w == w) && (e.downsample_ratio == downsample_ratio)) {
+			e.last_use = ++this->executor_clock;
+			return e.model;
+		}
+	}
+
+	/* Evict least recently used one if full */
+	if (this->executors.size() >= EXECUTOR_CACHE_SIZE) {
+		this->executors.erase(std::min_element(this->executors.begin(), this->executors.end(),
+			[](const executor &a, const executor &b) {
+				return a.last_use < b.last_use;
+			}
+		));
+	}
+
+	/* Create a new one from the loaded model and warm it up. The clone
+	 * only gets its own methods (hence executors), parameters are shared
+	 * with the loaded module. It's not frozen : the staged path
+	 * needs the submodules */
+	executor e;
+
+	e.h = h;
+	e.w = w;
+	e.downsample_ratio = downsample_ratio;
+	e.last_use = ++this->executor_clock;
+	e.model = this->model.clone(true);
+
+	modelWarmup(e.model, this->staged,
+		torch::zeros({1, 3, h, w}, torch::TensorOptions().device(this->dev).dtype(this->type)),
+		downsample_ratio
+	);
+
+	this->executors.push_back(e);
+
+	return e.model;
+}
+
+void
+TorchBackend::warmup(int h, int w, double downsample_ratio)
+{
+	torch::NoGradGuard no_grad_guard;
+
+	/* AOT models don't have any JIT to warm up */
+	if (this->aot)
+		return;
+
+	this->getExecutor(h, w, downsample_ratio);
+}
+
+void
+TorchBackend::forward(BackendForward &fwd)
+{
+	torch::NoGradGuard no_grad_guard;
+
+	const TorchState *state = static_cast<const TorchState *>(fwd.state.get());
+
+	/* Input */
+	torch::Tensor src = torch::from_blob(
+		(void *) fwd.src->data.data(),
+		{ 1, fwd.src->c, fwd.src->h, fwd.src->w },
+		torch::kFloat32
+	).to(this->dev, this->type);
+
+	/* Run the model */
+	std::vector<torch::Tensor> outputs;
+
+	if (this->aot)
+	{
+		/* AOT compiled model, takes states explicitely. Its batch size
+		 * is fixed at export, so no batching */
+		outputs = this->aot->forward(src, state ? state->rn : NULL);
+	}
+	else
+	{
+		/* TorchScript, possibly along with other instances requests.
+		 * For alpha only, the foreground refinement is skipped */
+		BatchRequest req;
+
+		req.src = src;
+		req.downsample_ratio = fwd.downsample_ratio;
+		req.alpha_only = !fwd.want_fgr && this->staged_alpha;
+		req.state = state;
+		req.cancel = fwd.cancel;
+		req.feature_reuse = this->staged ? fwd.feature_reuse : 0.0;
+
+		{
+			std::lock_guard<std::mutex> guard(this->features_lock);
+			if (req.feature_reuse <= 0.0)
+				this->features.reset();
+			req.features = this->features;
+		}
+
+		this->scheduler->run(*this, req);
+
+		if (req.outputs.empty()) {
+			fwd.cancelled = true;
+			return;
+		}
+
+		if (req.next_features) {
+			std::lock_guard<std::mutex> guard(this->features_lock);
+			this->features = req.next_features;
+		}
+
+		outputs = std::move(req.outputs);
+		fwd.features_reused = req.features_reused;
+	}
+
+	/* Recursive states for next run */
+	auto next_state = std::make_shared<TorchState>();
+
+	for (int i=0; i<4; i++)
+		next_state->rn[i] = outputs[2+i];
+
+	fwd.next_state = next_state;
+
+	/* Outputs */
+	if (fwd.want_fgr)
+		tensorToPlanar(fwd.fgr, outputs[0]);
+	tensorToPlanar(fwd.pha, outputs[1]);
+}
+
+
+void
+TorchBackend::runBatch(const std::vector<BatchRequest *> &batch)
+{
+	torch::NoGradGuard no_grad_guard;
+
+	const BatchRequest &first = *batch[0];
+	int n = batch.size();
+
+	/* Stacked inputs, and states if any has one (zeros are what the
+	 * model uses for a cold start) */
+	std::vector<torch::Tensor> srcs;
+	const TorchState *ref = NULL;
+
+	for (const BatchRequest *r : batch) {
+		srcs.push_back(r->src);
+		if (!ref)
+			ref = r->state;
+	}
+
+	torch::Tensor src = (n > 1) ? torch::cat(srcs, 0) : first.src;
+	torch::Tensor rn[4];
+
+	for (int i=0; ref && (i<4); i++) {
+		std::vector<torch::Tensor> r;
+
+		for (const BatchRequest *b : batch)
+			r.push_back(b->state ? b->state->rn[i] : torch::zeros_like(ref->rn[i]));
+
+		rn[i] = (n > 1) ? torch::cat(r, 0) : r[0];
+	}
+
+	/* Run, it's abandoned between stages once all its requests are */
+	torch::jit::script::Module model = this->getExecutor((int)first.src.size(2), (int)first.src.size(3), first.downsample_ratio);
+
+	auto cancelled = [&batch]() {
+		for (const BatchRequest *r : batch)
+			if (!backendCancelled(r->cancel))
+				return false;
+		return true;
+	};
+
+	/* Encoder passes are kept if any request asks for it, and the last
+	 * ones reused only if all have one of the same shape, stacked like
+	 * the inputs. The strictest threshold goes for all */
+	bool want_features = false;
+	bool have_features = true;
+	double reuse = std::numeric_limits<double>::infinity();
+
+	for (const BatchRequest *r : batch) {
+		want_features |= (r->feature_reuse > 0.0);
+		have_features = have_features && (r->feature_reuse > 0.0) && r->features &&
+			(r->features->src_sm.sizes() == first.features->src_sm.sizes());
+		reuse = std::min(reuse, r->feature_reuse);
+	}
+
+	TorchFeatures feat;
+
+	if (have_features) {
+		std::vector<torch::Tensor> src_sm, f1, f2, f3, f4;
+
+		for (const BatchRequest *r : batch) {
+			src_sm.push_back(r->features->src_sm);
+			f1.push_back(r->features->f1);
+			f2.push_back(r->features->f2);
+			f3.push_back(r->features->f3);
+			f4.push_back(r->features->f4);
+		}
+
+		feat.src_sm = (n > 1) ? torch::cat(src_sm, 0) : src_sm[0];
+		feat.f1 = (n > 1) ? torch::cat(f1, 0) : f1[0];
+		feat.f2 = (n > 1) ? torch::cat(f2, 0) : f2[0];
+		feat.f3 = (n > 1) ? torch::cat(f3, 0) : f3[0];
+		feat.f4 = (n > 1) ? torch::cat(f4, 0) : f4[0];
+	}
+
+	bool reused;
+
+	std::vector<torch::Tensor> outputs = modelForward(model, this->staged, src,
+		first.downsample_ratio, ref ? rn : NULL, first.alpha_only,
+		want_features ? &feat : NULL, reuse, reused, cancelled);
+
+	if (outputs.empty())
+		return;
+
+	/* Each keeps its slice of a new encoder pass, cloned like states.
+	 * The input always is, it can be the request one at ratio 1.0 */
+	for (int k=0; k<n; k++) {
+		BatchRequest *r = batch[k];
+
+		r->features_reused = reused;
+
+		if (r->feature_reuse <= 0.0)
+			continue;
+
+		if (reused) {
+			r->next_features = r->features;
+			continue;
+		}
+
+		auto slice = [&](torch::Tensor t) {
+			return (n > 1) ? t.narrow(0, k, 1).clone() : t;
+		};
+
+		auto f = std::make_shared<TorchFeatures>();
+
+		f->src_sm = feat.src_sm.narrow(0, k, 1).clone();
+		f->f1 = slice(feat.f1);
+		f->f2 = slice(feat.f2);
+		f->f3 = slice(feat.f3);
+		f->f4 = slice(feat.f4);
+
+		r->next_features = f;
+	}
+
+	/* Scatter back. Outputs are copied out, but states get kept (cached
+	 * as checkpoints) : they're cloned so they don't hold the whole batch */
+	for (int k=0; k<n; k++) {
+		for (size_t i=0; i<outputs.size(); i++) {
+			torch::Tensor t = outputs[i];
+			if (t.defined() && (n > 1)) {
+				t = t.narrow(0, k, 1);
+				if (i >= 2)
+					t = t.clone();
+			}
+			batch[k]->outputs.push_back(t);
+		}
+	}
+}
+
+bool
+TorchBackend::stateExport(PlanarImage rn[4], const BackendState &state) const
+{
+	const TorchState &ts = static_cast<const TorchState &>(state);
+
+	for (int i=0; i<4; i++)
+		tensorToPlanar(rn[i], ts.rn[i]);
+
+	return true;
+}
+
+BackendStatePtr
+TorchBackend::stateImport(const PlanarImage rn[4]) const
+{
+	auto state = std::make_shared<TorchState>();
+
+	for (int i=0; i<4; i++) {
+		state->rn[i] = torch::from_blob(
+			(void *) rn[i].data.data(),
+			{ 1, rn[i].c, rn[i].h, rn[i].w },
+			torch::kFloat32
+		).to(this->dev, this->type, false, true);
+	}
+
+	return state;
+}
+
+BACKEND_MODULE_EXPORT Backend *
+rvmofxBackendCreate(int api_version, enum backendType type, const BackendConfig *cfg, char *err, size_t err_len)
+{
+	if (api_version != BACKEND_MODULE_API_VERSION) {
+		snprintf(err, err_len, "Backend module API version mismatch");
+		return NULL;
+	}
+
+	try {
+		return new TorchBackend(*cfg, type == BACKEND_TORCH_AOT);
+	} catch (const std::exception& e) {
+		snprintf(err, err_len, "%s", e.what());
+		return NULL;
+	}
+}
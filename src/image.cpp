@@ -0,0 +1,757 @@
+/*
+ * image.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * Conversion between OFX images and backend planar images
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "ofxCore.h"
+#include "ofxImageEffect.h"
+#include "ofxPixels.h"
+
+#include "image.h"
+
+
+/* ------------------------------------------------------------------------- */
+/* Pixel formats                                                             */
+/* ------------------------------------------------------------------------- */
+
+struct half_t {
+	uint16_t v;
+};
+
+static inline float
+halfToFloat(uint16_t h)
+{
+	uint32_t s = (uint32_t)(h & 0x8000) << 16;
+	uint32_t e = (h >> 10) & 0x1f;
+	uint32_t m = h & 0x3ff;
+	uint32_t f;
+	float r;
+
+	if (e == 0) {
+		if (m == 0) {
+			f = s;
+		} else {
+			/* Subnormal, normalize it */
+			e = 127 - 15 + 1;
+			while (!(m & 0x400)) {
+				m <<= 1;
+				e--;
+			}
+			f = s | (e << 23) | ((m & 0x3ff) << 13);
+		}
+	} else if (e == 31) {
+		f = s | 0x7f800000 | (m << 13);
+	} else {
+		f = s | ((e + 127 - 15) << 23) | (m << 13);
+	}
+
+	memcpy(&r, &f, sizeof(float));
+	return r;
+}
+
+static inline uint16_t
+floatToHalf(float v)
+{
+	uint32_t f;
+	memcpy(&f, &v, sizeof(float));
+
+	uint16_t s = (f >> 16) & 0x8000;
+	int32_t  e = (int32_t)((f >> 23) & 0xff) - 127 + 15;
+	uint32_t m = f & 0x7fffff;
+
+	/* Inf / NaN */
+	if (((f >> 23) & 0xff) == 0xff)
+		return s | 0x7c00 | (m ? 0x200 : 0);
+
+	/* Overflow */
+	if (e >= 31)
+		return s | 0x7c00;
+
+	/* Subnormal / Underflow */
+	if (e <= 0) {
+		if (e < -10)
+			return s;
+
+		m |= 0x800000;
+		int shift = 14 - e;
+		uint16_t h = s | (m >> shift);
+		if ((m >> (shift - 1)) & 1)
+			h++;
+		return h;
+	}
+
+	/* Normal (rounding may carry into exponent, which is correct) */
+	uint16_t h = s | (e << 10) | (m >> 13);
+	if (m & 0x1000)
+		h++;
+	return h;
+}
+
+static inline float pixLoad(const uint8_t  *p) { return *p * (1.0f / 255.0f); }
+static inline float pixLoad(const uint16_t *p) { return *p * (1.0f / 65535.0f); }
+static inline float pixLoad(const half_t   *p) { return halfToFloat(p->v); }
+static inline float pixLoad(const float    *p) { return *p; }
+
+static inline void pixStore(uint8_t  *p, float v) { *p = (uint8_t) (std::min(std::max(v, 0.0f), 1.0f) * 255.0f   + 0.5f); }
+static inline void pixStore(uint16_t *p, float v) { *p = (uint16_t)(std::min(std::max(v, 0.0f), 1.0f) * 65535.0f + 0.5f); }
+static inline void pixStore(half_t   *p, float v) { p->v = floatToHalf(v); }
+static inline void pixStore(float    *p, float v) { *p = v; }
+
+
+enum pixelDepth {
+	DEPTH_NONE,
+	DEPTH_BYTE,
+	DEPTH_SHORT,
+	DEPTH_HALF,
+	DEPTH_FLOAT,
+};
+
+static enum pixelDepth
+getPixelDepth(const ImageInfo &img)
+{
+	if (!strcmp(img.pixelDepth, kOfxBitDepthByte))
+		return DEPTH_BYTE;
+	else if (!strcmp(img.pixelDepth, kOfxBitDepthShort))
+		return DEPTH_SHORT;
+	else if (!strcmp(img.pixelDepth, kOfxBitDepthHalf))
+		return DEPTH_HALF;
+	else if (!strcmp(img.pixelDepth, kOfxBitDepthFloat))
+		return DEPTH_FLOAT;
+	return DEPTH_NONE;
+}
+
+static int
+getComponentSize(enum pixelDepth depth)
+{
+	switch (depth) {
+	case DEPTH_BYTE:  return 1;
+	case DEPTH_SHORT: return 2;
+	case DEPTH_HALF:  return 2;
+	case DEPTH_FLOAT: return 4;
+	default:
+		return 0;
+	}
+}
+
+static int
+getComponentCount(const ImageInfo &img)
+{
+	if (!strcmp(img.components, kOfxImageComponentRGBA))
+		return 4;
+	else if (!strcmp(img.components, kOfxImageComponentRGB))
+		return 3;
+	else if (!strcmp(img.components, kOfxImageComponentAlpha))
+		return 1;
+	return 0;
+}
+
+template<typename T>
+static inline T *
+imageRow(const ImageInfo &img, int y)
+{
+	/* Data points to (x1,y1), rowBytes can be negative */
+	return (T *)((uint8_t *)img.ptr + (ptrdiff_t)img.rowBytes * y);
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Mattes                                                                    */
+/* ------------------------------------------------------------------------- */
+
+/* Integer that's > 0 iff the pixel value is > 0, so that row scans are
+ * plain integer max reductions the compiler can vectorize */
+static inline int32_t alphaKey(uint8_t  v) { return v; }
+static inline int32_t alphaKey(uint16_t v) { return v; }
+static inline int32_t alphaKey(half_t   v) { return (int16_t)v.v; }
+static inline int32_t alphaKey(float    v) { int32_t i; memcpy(&i, &v, sizeof(float)); return i; }
+
+/* Same, key of the 1.0 value (anything above is opaque as well) */
+static inline int32_t alphaKeyOne(const uint8_t  *) { return 0xff; }
+static inline int32_t alphaKeyOne(const uint16_t *) { return 0xffff; }
+static inline int32_t alphaKeyOne(const half_t   *) { return 0x3c00; }
+static inline int32_t alphaKeyOne(const float    *) { return 0x3f800000; }
+
+template<typename T>
+static bool
+imageAlphaBoundsT(OfxRectI &bbox, const ImageInfo &img, int nc)
+{
+	int w = img.rect.x2 - img.rect.x1;
+	int h = img.rect.y2 - img.rect.y1;
+	int x0 = w, x1 = 0, y0 = h, y1 = 0;
+
+	for (int y=0; y<h; y++)
+	{
+		const T *row = imageRow<const T>(img, y) + (nc - 1);
+		int32_t m = 0;
+
+		/* Whole row first, only look for the edges if needed */
+		if (nc == 1) {
+			for (int x=0; x<w; x++)
+				m = std::max(m, alphaKey(row[x]));
+		} else {
+			for (int x=0; x<w; x++)
+				m = std::max(m, alphaKey(row[x * nc]));
+		}
+
+		if (m <= 0)
+			continue;
+
+		int l = 0, r = w - 1;
+		while (alphaKey(row[l * nc]) <= 0) l++;
+		while (alphaKey(row[r * nc]) <= 0) r--;
+
+		x0 = std::min(x0, l);
+		x1 = std::max(x1, r + 1);
+		y0 = std::min(y0, y);
+		y1 = y + 1;
+	}
+
+	if (y0 >= y1)
+		return false;
+
+	bbox.x1 = img.rect.x1 + x0;
+	bbox.x2 = img.rect.x1 + x1;
+	bbox.y1 = img.rect.y1 + y0;
+	bbox.y2 = img.rect.y1 + y1;
+
+	return true;
+}
+
+bool
+imageAlphaBounds(OfxRectI &bbox, const ImageInfo &img)
+{
+	int nc = getComponentCount(img);
+
+	if (!nc || (img.rect.x2 <= img.rect.x1) || (img.rect.y2 <= img.rect.y1))
+		return false;
+
+	switch (getPixelDepth(img)) {
+	case DEPTH_BYTE:  return imageAlphaBoundsT<uint8_t> (bbox, img, nc);
+	case DEPTH_SHORT: return imageAlphaBoundsT<uint16_t>(bbox, img, nc);
+	case DEPTH_HALF:  return imageAlphaBoundsT<half_t>  (bbox, img, nc);
+	case DEPTH_FLOAT: return imageAlphaBoundsT<float>   (bbox, img, nc);
+	default:
+		return false;
+	}
+}
+
+template<typename T>
+static bool
+imageAlphaCoversT(const ImageInfo &img, const OfxRectI &rect, int nc)
+{
+	const int32_t one = alphaKeyOne((const T *)NULL);
+	int w = rect.x2 - rect.x1;
+
+	for (int y=rect.y1; y<rect.y2; y++)
+	{
+		const T *row = imageRow<const T>(img, y - img.rect.y1) + (rect.x1 - img.rect.x1) * nc + (nc - 1);
+		int32_t m = INT32_MAX;
+
+		if (nc == 1) {
+			for (int x=0; x<w; x++)
+				m = std::min(m, alphaKey(row[x]));
+		} else {
+			for (int x=0; x<w; x++)
+				m = std::min(m, alphaKey(row[x * nc]));
+		}
+
+		if (m < one)
+			return false;
+	}
+
+	return true;
+}
+
+bool
+imageAlphaCovers(const ImageInfo &img, const OfxRectI &rect)
+{
+	int nc = getComponentCount(img);
+
+	if (!nc || (rect.x1 < img.rect.x1) || (rect.x2 > img.rect.x2) ||
+	    (rect.y1 < img.rect.y1) || (rect.y2 > img.rect.y2))
+		return false;
+
+	switch (getPixelDepth(img)) {
+	case DEPTH_BYTE:  return imageAlphaCoversT<uint8_t> (img, rect, nc);
+	case DEPTH_SHORT: return imageAlphaCoversT<uint16_t>(img, rect, nc);
+	case DEPTH_HALF:  return imageAlphaCoversT<half_t>  (img, rect, nc);
+	case DEPTH_FLOAT: return imageAlphaCoversT<float>   (img, rect, nc);
+	default:
+		return false;
+	}
+}
+
+template<typename T>
+static void
+matteRowT(float *dst, const ImageInfo &img, int nc, int y, int x0, int n)
+{
+	/* Canvas coordinates, zero outside of the matte */
+	int mx0 = std::max(x0, img.rect.x1) - x0;
+	int mx1 = std::min(x0 + n, img.rect.x2) - x0;
+
+	if ((y < img.rect.y1) || (y >= img.rect.y2) || (mx0 >= mx1)) {
+		std::fill(dst, dst + n, 0.0f);
+		return;
+	}
+
+	const T *row = imageRow<const T>(img, y - img.rect.y1) + (x0 + mx0 - img.rect.x1) * nc + (nc - 1);
+
+	std::fill(dst, dst + mx0, 0.0f);
+	for (int x=mx0; x<mx1; x++, row+=nc)
+		dst[x] = pixLoad(row);
+	std::fill(dst + mx1, dst + n, 0.0f);
+}
+
+static void
+matteRow(float *dst, const ImageInfo &img, int y, int x0, int n)
+{
+	int nc = getComponentCount(img);
+
+	switch (nc ? getPixelDepth(img) : DEPTH_NONE) {
+	case DEPTH_BYTE:  matteRowT<uint8_t> (dst, img, nc, y, x0, n); break;
+	case DEPTH_SHORT: matteRowT<uint16_t>(dst, img, nc, y, x0, n); break;
+	case DEPTH_HALF:  matteRowT<half_t>  (dst, img, nc, y, x0, n); break;
+	case DEPTH_FLOAT: matteRowT<float>   (dst, img, nc, y, x0, n); break;
+	default:
+		std::fill(dst, dst + n, 1.0f);
+		break;
+	}
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Input conversion                                                          */
+/* ------------------------------------------------------------------------- */
+
+template<typename T>
+static void
+imageToPlanarT(PlanarImage &dst, const ImageInfo &img, const OfxRectI &roi, int nc)
+{
+	int w = roi.x2 - roi.x1;
+	int h = roi.y2 - roi.y1;
+
+	for (int y=0; y<dst.h; y++)
+	{
+		const T *src = imageRow<const T>(img, roi.y1 - img.rect.y1 + std::min(y, h - 1)) +
+			(roi.x1 - img.rect.x1) * nc;
+		float *dr = dst.plane(0) + (size_t)y * dst.w;
+		float *dg = dst.plane(1) + (size_t)y * dst.w;
+		float *db = dst.plane(2) + (size_t)y * dst.w;
+
+		for (int x=0; x<w; x++) {
+			dr[x] = pixLoad(&src[0]);
+			dg[x] = pixLoad(&src[1]);
+			db[x] = pixLoad(&src[2]);
+			src += nc;
+		}
+
+		for (int x=w; x<dst.w; x++) {
+			dr[x] = dr[w-1];
+			dg[x] = dg[w-1];
+			db[x] = db[w-1];
+		}
+	}
+}
+
+bool
+imageToPlanar(PlanarImage &dst, const ImageInfo &img, const OfxRectI &roi, int pad_h, int pad_w)
+{
+	int w = roi.x2 - roi.x1;
+	int h = roi.y2 - roi.y1;
+	int nc = getComponentCount(img);
+
+	/* Need RGB or RGBA (alpha is dropped) */
+	if (((nc != 3) && (nc != 4)) || (w <= 0) || (h <= 0))
+		return false;
+
+	if ((roi.x1 < img.rect.x1) || (roi.x2 > img.rect.x2) ||
+	    (roi.y1 < img.rect.y1) || (roi.y2 > img.rect.y2))
+		return false;
+
+	dst = PlanarImage(3, std::max(h, pad_h), std::max(w, pad_w));
+
+	switch (getPixelDepth(img)) {
+	case DEPTH_BYTE:  imageToPlanarT<uint8_t> (dst, img, roi, nc); break;
+	case DEPTH_SHORT: imageToPlanarT<uint16_t>(dst, img, roi, nc); break;
+	case DEPTH_HALF:  imageToPlanarT<half_t>  (dst, img, roi, nc); break;
+	case DEPTH_FLOAT: imageToPlanarT<float>   (dst, img, roi, nc); break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/* Largest difference to the border color still part of the border (room
+ * for compression noise), and border size granularity. Sizes are rounded
+ * down to limit the changes of model input shape */
+#define BORDER_TOLERANCE	(4.0f / 255.0f)
+#define BORDER_ALIGN		8
+
+/* Smallest active area size worth cropping to (this is about bars, not
+ * about nearly uniform frames with a few details) */
+#define BORDER_ACTIVE_MIN	64
+
+template<typename T>
+static inline bool
+borderPixel(const T *p, const float *ref)
+{
+	return  (std::abs(pixLoad(&p[0]) - ref[0]) <= BORDER_TOLERANCE) &&
+		(std::abs(pixLoad(&p[1]) - ref[1]) <= BORDER_TOLERANCE) &&
+		(std::abs(pixLoad(&p[2]) - ref[2]) <= BORDER_TOLERANCE);
+}
+
+template<typename T>
+static bool
+borderRow(const ImageInfo &img, int nc, int y, int x1, int x2, const float *ref)
+{
+	const T *p = imageRow<const T>(img, y) + x1 * nc;
+
+	for (int x=x1; x<x2; x++, p+=nc)
+		if (!borderPixel(p, ref))
+			return false;
+
+	return true;
+}
+
+template<typename T>
+static bool
+borderCol(const ImageInfo &img, int nc, int x, int y1, int y2, const float *ref)
+{
+	for (int y=y1; y<y2; y++)
+		if (!borderPixel(imageRow<const T>(img, y) + x * nc, ref))
+			return false;
+
+	return true;
+}
+
+template<typename T>
+static bool
+imageActiveBoundsT(OfxRectI &active, const ImageInfo &img, int nc)
+{
+	int w = img.rect.x2 - img.rect.x1;
+	int h = img.rect.y2 - img.rect.y1;
+	int b_y1 = 0, b_y2 = 0, b_x1 = 0, b_x2 = 0;
+	float ref[3];
+
+	/* Border color from the corner. The scans stop at the first pixel
+	 * that doesn't match, so only the borders are really read */
+	const T *p = imageRow<const T>(img, 0);
+	for (int c=0; c<3; c++)
+		ref[c] = pixLoad(&p[c]);
+
+	while ((b_y1 < h) && borderRow<T>(img, nc, b_y1, 0, w, ref))
+		b_y1++;
+
+	if (b_y1 == h) {
+		active = OfxRectI{ img.rect.x1, img.rect.y1, img.rect.x1, img.rect.y1 };
+		return true;
+	}
+
+	while (borderRow<T>(img, nc, h - 1 - b_y2, 0, w, ref))
+		b_y2++;
+
+	while (borderCol<T>(img, nc, b_x1, b_y1, h - b_y2, ref))
+		b_x1++;
+
+	while (borderCol<T>(img, nc, w - 1 - b_x2, b_y1, h - b_y2, ref))
+		b_x2++;
+
+	b_y1 -= b_y1 % BORDER_ALIGN;
+	b_y2 -= b_y2 % BORDER_ALIGN;
+	b_x1 -= b_x1 % BORDER_ALIGN;
+	b_x2 -= b_x2 % BORDER_ALIGN;
+
+	if ((h - b_y1 - b_y2) < BORDER_ACTIVE_MIN)
+		b_y1 = b_y2 = 0;
+
+	if ((w - b_x1 - b_x2) < BORDER_ACTIVE_MIN)
+		b_x1 = b_x2 = 0;
+
+	active = OfxRectI{
+		img.rect.x1 + b_x1, img.rect.y1 + b_y1,
+		img.rect.x2 - b_x2, img.rect.y2 - b_y2,
+	};
+
+	return b_x1 || b_x2 || b_y1 || b_y2;
+}
+
+bool
+imageActiveBounds(OfxRectI &active, const ImageInfo &img)
+{
+	int nc = getComponentCount(img);
+
+	active = img.rect;
+
+	if (((nc != 3) && (nc != 4)) || (img.rect.x2 <= img.rect.x1) || (img.rect.y2 <= img.rect.y1))
+		return false;
+
+	switch (getPixelDepth(img)) {
+	case DEPTH_BYTE:  return imageActiveBoundsT<uint8_t> (active, img, nc);
+	case DEPTH_SHORT: return imageActiveBoundsT<uint16_t>(active, img, nc);
+	case DEPTH_HALF:  return imageActiveBoundsT<half_t>  (active, img, nc);
+	case DEPTH_FLOAT: return imageActiveBoundsT<float>   (active, img, nc);
+	default:
+		return false;
+	}
+}
+
+/* Hash of the raw pixel bytes. Four independent multiply / rotate lanes
+ * over 64 bit words, to run at about memory speed */
+#define HASH_PRIME1	0x9e3779b97f4a7c15ULL
+#define HASH_PRIME2	0xc2b2ae3d27d4eb4fULL
+
+static inline uint64_t
+hashRound(uint64_t h, uint64_t v)
+{
+	h ^= v * HASH_PRIME2;
+	h = (h << 31) | (h >> 33);
+	return h * HASH_PRIME1;
+}
+
+uint64_t
+imageHash(const ImageInfo &img, const OfxRectI &roi)
+{
+	int cs = getComponentSize(getPixelDepth(img));
+	int nc = getComponentCount(img);
+
+	if (!cs || !nc || (roi.x2 <= roi.x1) || (roi.y2 <= roi.y1) ||
+	    (roi.x1 < img.rect.x1) || (roi.x2 > img.rect.x2) ||
+	    (roi.y1 < img.rect.y1) || (roi.y2 > img.rect.y2))
+		return 0;
+
+	size_t len = (size_t)(roi.x2 - roi.x1) * nc * cs;
+	uint64_t h[4] = { 1, 2, 3, 4 };
+
+	for (int y=roi.y1; y<roi.y2; y++)
+	{
+		const uint8_t *row = imageRow<const uint8_t>(img, y - img.rect.y1) + (size_t)(roi.x1 - img.rect.x1) * nc * cs;
+		size_t i = 0;
+
+		for (; i+32<=len; i+=32) {
+			uint64_t v[4];
+			memcpy(v, row + i, 32);
+			h[0] = hashRound(h[0], v[0]);
+			h[1] = hashRound(h[1], v[1]);
+			h[2] = hashRound(h[2], v[2]);
+			h[3] = hashRound(h[3], v[3]);
+		}
+
+		for (; i<len; i++)
+			h[0] = hashRound(h[0], row[i]);
+	}
+
+	return hashRound(hashRound(h[0], h[1]), hashRound(h[2], h[3]));
+}
+
+/* Signature grid size, fixed whatever the image size */
+#define SIGNATURE_GRID	16
+
+template<typename T>
+static void
+imageSignatureT(float *sig, const ImageInfo &img, int nc, const OfxRectI &roi)
+{
+	int w = roi.x2 - roi.x1;
+	int h = roi.y2 - roi.y1;
+
+	for (int gy=0; gy<SIGNATURE_GRID; gy++)
+	{
+		int y1 = roi.y1 + (h *  gy     ) / SIGNATURE_GRID;
+		int y2 = roi.y1 + (h * (gy + 1)) / SIGNATURE_GRID;
+		float acc[SIGNATURE_GRID] = { 0.0f };
+
+		/* Row by row over the whole grid line, to read memory in order */
+		for (int y=y1; y<y2; y++)
+		{
+			const T *row = imageRow<const T>(img, y - img.rect.y1);
+
+			for (int gx=0; gx<SIGNATURE_GRID; gx++) {
+				int x1 = roi.x1 + (w *  gx     ) / SIGNATURE_GRID;
+				int x2 = roi.x1 + (w * (gx + 1)) / SIGNATURE_GRID;
+				const T *p = row + (size_t)(x1 - img.rect.x1) * nc;
+				float s = 0.0f;
+
+				for (int x=x1; x<x2; x++, p+=nc)
+					s += pixLoad(&p[0]) + pixLoad(&p[1]) + pixLoad(&p[2]);
+
+				acc[gx] += s;
+			}
+		}
+
+		for (int gx=0; gx<SIGNATURE_GRID; gx++) {
+			int n = (y2 - y1) * ((w * (gx + 1)) / SIGNATURE_GRID - (w * gx) / SIGNATURE_GRID);
+			sig[gy * SIGNATURE_GRID + gx] = n ? (acc[gx] / (3.0f * n)) : 0.0f;
+		}
+	}
+}
+
+bool
+imageSignature(std::vector<float> &sig, const ImageInfo &img, const OfxRectI &roi)
+{
+	int nc = getComponentCount(img);
+
+	sig.clear();
+
+	if (((nc != 3) && (nc != 4)) || (roi.x2 <= roi.x1) || (roi.y2 <= roi.y1) ||
+	    (roi.x1 < img.rect.x1) || (roi.x2 > img.rect.x2) ||
+	    (roi.y1 < img.rect.y1) || (roi.y2 > img.rect.y2))
+		return false;
+
+	sig.resize(SIGNATURE_GRID * SIGNATURE_GRID);
+
+	switch (getPixelDepth(img)) {
+	case DEPTH_BYTE:  imageSignatureT<uint8_t> (sig.data(), img, nc, roi); break;
+	case DEPTH_SHORT: imageSignatureT<uint16_t>(sig.data(), img, nc, roi); break;
+	case DEPTH_HALF:  imageSignatureT<half_t>  (sig.data(), img, nc, roi); break;
+	case DEPTH_FLOAT: imageSignatureT<float>   (sig.data(), img, nc, roi); break;
+	default:
+		sig.clear();
+		return false;
+	}
+
+	return true;
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Output conversion                                                         */
+/* ------------------------------------------------------------------------- */
+
+template<typename T>
+static inline void
+pixClear(T *dst, int nc, int n)
+{
+	for (int i=0; i<nc*n; i++)
+		pixStore(&dst[i], 0.0f);
+}
+
+template<typename T>
+static void
+planarToImageT(const ImageInfo &img, int nc, const OfxRectI &roi,
+	const PlanarImage &color, const PlanarImage &pha,
+	const ImageInfo *garbage, const ImageInfo *solid,
+	bool rgba, bool postmultiply)
+{
+	int w = img.rect.x2 - img.rect.x1;
+	int h = img.rect.y2 - img.rect.y1;
+
+	/* Columns of the image covered by roi */
+	int xa = std::min(w, std::max(0, roi.x1 - img.rect.x1));
+	int xb = std::min(w, std::max(xa, roi.x2 - img.rect.x1));
+
+	/* Mattes rows (and zero alpha if none is given) */
+	std::vector<float> grow(garbage ? (xb - xa) : 0);
+	std::vector<float> srow(solid ? (xb - xa) : 0);
+	std::vector<float> zrow(pha.empty() ? (xb - xa) : 0, 0.0f);
+
+	for (int y=0; y<h; y++)
+	{
+		T *dst = imageRow<T>(img, y);
+		int cy = img.rect.y1 + y;
+
+		if ((cy < roi.y1) || (cy >= roi.y2) || (xa >= xb)) {
+			pixClear(dst, nc, w);
+			continue;
+		}
+
+		size_t ofs = (size_t)(cy - roi.y1) * pha.w + (img.rect.x1 + xa - roi.x1);
+		size_t cofs = (size_t)(cy - roi.y1) * color.w + (img.rect.x1 + xa - roi.x1);
+		const float *sa = pha.empty() ? zrow.data() : pha.plane(0) + ofs;
+		const float *sr = rgba ? color.plane(0) + cofs : NULL;
+		const float *sg = rgba ? color.plane(1) + cofs : NULL;
+		const float *sb = rgba ? color.plane(2) + cofs : NULL;
+
+		if (garbage)
+			matteRow(grow.data(), *garbage, cy, img.rect.x1 + xa, xb - xa);
+		if (solid)
+			matteRow(srow.data(), *solid, cy, img.rect.x1 + xa, xb - xa);
+
+		pixClear(dst, nc, xa);
+		dst += nc * xa;
+
+		for (int x=0; x<xb-xa; x++)
+		{
+			float va = sa[x];
+
+			if (solid)
+				va = std::max(va, srow[x]);
+			if (garbage)
+				va *= grow[x];
+
+			/* Alpha only output repeats the final alpha */
+			float vr = rgba ? sr[x] : va;
+			float vg = rgba ? sg[x] : va;
+			float vb = rgba ? sb[x] : va;
+
+			if (rgba && postmultiply) {
+				vr *= va;
+				vg *= va;
+				vb *= va;
+			}
+
+			switch (nc) {
+			case 4:
+				pixStore(&dst[3], va);
+				/* fall through */
+			case 3:
+				pixStore(&dst[0], vr);
+				pixStore(&dst[1], vg);
+				pixStore(&dst[2], vb);
+				break;
+			case 1:
+				pixStore(&dst[0], va);
+				break;
+			}
+
+			dst += nc;
+		}
+
+		pixClear(dst, nc, w - xb);
+	}
+}
+
+bool
+planarToImage(const ImageInfo &img, const OfxRectI &roi,
+	const PlanarImage &color, const PlanarImage &pha,
+	const ImageInfo *garbage, const ImageInfo *solid,
+	bool rgba, bool postmultiply)
+{
+	int w = roi.x2 - roi.x1;
+	int h = roi.y2 - roi.y1;
+	int nc = getComponentCount(img);
+
+	if (!nc)
+		return false;
+
+	/* Sanity check sizes */
+	if (!pha.empty() && ((pha.h < h) || (pha.w < w)))
+		return false;
+
+	if (rgba && ((color.c < 3) || (color.h < h) || (color.w < w)))
+		return false;
+
+	switch (getPixelDepth(img)) {
+	case DEPTH_BYTE:  planarToImageT<uint8_t> (img, nc, roi, color, pha, garbage, solid, rgba, postmultiply); break;
+	case DEPTH_SHORT: planarToImageT<uint16_t>(img, nc, roi, color, pha, garbage, solid, rgba, postmultiply); break;
+	case DEPTH_HALF:  planarToImageT<half_t>  (img, nc, roi, color, pha, garbage, solid, rgba, postmultiply); break;
+	case DEPTH_FLOAT: planarToImageT<float>   (img, nc, roi, color, pha, garbage, solid, rgba, postmultiply); break;
+	default:
+		return false;
+	}
+
+	return true;
+}
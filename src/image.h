@@ -0,0 +1,66 @@
+/*
+ * image.h
+ *
+ * vim: ts=8 sw=8
+ *
+ * Conversion between OFX images and backend planar images
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "ofxCore.h"
+#include "ofxImageEffect.h"
+
+#include "backend.h"
+
+
+struct ImageInfo {
+	OfxPropertySetHandle h;
+	OfxRectI rect;
+	int rowBytes;
+	void *ptr;
+	char *pixelDepth;
+	char *components;
+};
+
+/* Convert the 'roi' part (canvas coordinates, within the image bounds) of
+ * a RGB(A) image to planar RGB, padded (replicating edges) to the given
+ * size if larger than the roi */
+bool imageToPlanar(PlanarImage &dst, const ImageInfo &img, const OfxRectI &roi, int pad_h, int pad_w);
+
+/* Find constant color borders (letterbox / pillarbox) of a RGB(A) image
+ * and return the active picture area in canvas coordinates (empty if the
+ * whole image is constant). Returns false if there are no borders */
+bool imageActiveBounds(OfxRectI &active, const ImageInfo &img);
+
+/* Content hash of the 'roi' part (canvas coordinates, within the image
+ * bounds) of an image, to tell if a frame is still what it was */
+uint64_t imageHash(const ImageInfo &img, const OfxRectI &roi);
+
+/* Coarse content signature of the 'roi' part (canvas coordinates, within
+ * the image bounds) of a RGB(A) image : mean level of each cell of a fixed
+ * grid, to tell how much a frame changed from another one */
+bool imageSignature(std::vector<float> &sig, const ImageInfo &img, const OfxRectI &roi);
+
+/* Write model output for 'roi' to image, everything outside of it is
+ * cleared. 'color' is only used for RGBA output. Both can be larger than
+ * the roi (padding is cropped), and 'pha' can be empty (all zero). The
+ * optional mattes are applied on the way : max(pha, solid) * garbage */
+bool planarToImage(const ImageInfo &img, const OfxRectI &roi,
+	const PlanarImage &color, const PlanarImage &pha,
+	const ImageInfo *garbage, const ImageInfo *solid,
+	bool rgba, bool postmultiply);
+
+/* Bounding box (canvas coordinates) of the non-zero pixels of an alpha
+ * matte. Returns false if it's all zero */
+bool imageAlphaBounds(OfxRectI &bbox, const ImageInfo &img);
+
+/* Returns true if an alpha matte is fully opaque over 'rect' (canvas
+ * coordinates) */
+bool imageAlphaCovers(const ImageInfo &img, const OfxRectI &rect);
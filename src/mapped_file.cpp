@@ -0,0 +1,129 @@
+/*
+ * mapped_file.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * Read-only memory mapped files
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+# define NOMINMAX
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#include "mapped_file.h"
+
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const char *filename) :
+	ptr(nullptr), len(0), h_file(INVALID_HANDLE_VALUE), h_map(NULL)
+{
+	LARGE_INTEGER sz;
+
+	this->h_file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (this->h_file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error(std::string("Unable to open ") + filename);
+
+	if (!GetFileSizeEx(this->h_file, &sz) || !sz.QuadPart) {
+		CloseHandle(this->h_file);
+		throw std::runtime_error(std::string("Unable to map ") + filename);
+	}
+
+	this->len = (size_t)sz.QuadPart;
+
+	this->h_map = CreateFileMappingA(this->h_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (this->h_map)
+		this->ptr = (const uint8_t *)MapViewOfFile(this->h_map, FILE_MAP_READ, 0, 0, 0);
+
+	if (!this->ptr) {
+		if (this->h_map)
+			CloseHandle(this->h_map);
+		CloseHandle(this->h_file);
+		throw std::runtime_error(std::string("Unable to map ") + filename);
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	UnmapViewOfFile(this->ptr);
+	CloseHandle(this->h_map);
+	CloseHandle(this->h_file);
+}
+
+std::string
+mappedFileKey(const char *filename)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+
+	if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &attr))
+		return filename;
+
+	return std::string(filename) +
+		"|" + std::to_string(((uint64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow) +
+		"|" + std::to_string(((uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime);
+}
+
+#else
+
+MappedFile::MappedFile(const char *filename) :
+	ptr(nullptr), len(0)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error(std::string("Unable to open ") + filename + ": " + strerror(errno));
+
+	if ((fstat(fd, &st) < 0) || !st.st_size) {
+		close(fd);
+		throw std::runtime_error(std::string("Unable to map ") + filename);
+	}
+
+	this->len = st.st_size;
+
+	/* The mapping stays valid after close */
+	p = mmap(NULL, this->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED)
+		throw std::runtime_error(std::string("Unable to map ") + filename + ": " + strerror(errno));
+
+	this->ptr = (const uint8_t *)p;
+}
+
+MappedFile::~MappedFile()
+{
+	munmap((void *)this->ptr, this->len);
+}
+
+std::string
+mappedFileKey(const char *filename)
+{
+	struct stat st;
+
+	if (stat(filename, &st) < 0)
+		return filename;
+
+	return std::string(filename) +
+		"|" + std::to_string((uint64_t)st.st_size) +
+		"|" + std::to_string((int64_t)st.st_mtime);
+}
+
+#endif
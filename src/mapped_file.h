@@ -0,0 +1,50 @@
+/*
+ * mapped_file.h
+ *
+ * vim: ts=8 sw=8
+ *
+ * Read-only memory mapped files
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+
+/* Whole file mapped read-only, so all processes using the same model share
+ * the page cache copy instead of each reading it to private memory. The
+ * mapping is private (and never written to, so nothing gets copied). That
+ * doesn't snapshot the file though : a model still in use should be
+ * replaced (written aside then renamed over) rather than rewritten in place,
+ * whose changes may show through and which faults on access if truncated */
+class MappedFile {
+public:
+	MappedFile(const char *filename);	/* Throws on error */
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	const uint8_t *data() const { return this->ptr; }
+	size_t size() const { return this->len; }
+
+private:
+	const uint8_t *ptr;
+	size_t len;
+#ifdef _WIN32
+	void *h_file, *h_map;
+#endif
+};
+
+typedef std::shared_ptr<const MappedFile> MappedFilePtr;
+
+/* Path along with the current size and modification time, to key caches of
+ * things loaded from a file so a rewritten file isn't served stale. Just the
+ * path if the file can't be stat'ed */
+std::string mappedFileKey(const char *filename);
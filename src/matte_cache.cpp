@@ -0,0 +1,109 @@
+/*
+ * matte_cache.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * Cache of model results, with the recurrent state following each frame
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "matte_cache.h"
+
+
+template<typename K> void
+MatteCacheT<K>::setLimit(size_t bytes)
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	this->limit = bytes;
+	this->evict();
+}
+
+template<typename K> void
+MatteCacheT<K>::clear()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	this->slots.clear();
+	this->used = 0;
+	this->gen++;
+}
+
+template<typename K> void
+MatteCacheT<K>::insert(K key, MatteCacheEntryPtr entry)
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	if (!this->limit || (entry->size() > this->limit))
+		return;
+
+	Slot &slot = this->slots[key];
+
+	if (slot.entry)
+		this->used -= slot.entry->size();
+
+	slot.entry = entry;
+	slot.last_use = ++this->tick;
+
+	this->used += entry->size();
+	this->evict();
+}
+
+template<typename K> MatteCacheEntryPtr
+MatteCacheT<K>::find(K key)
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	auto it = this->slots.find(key);
+	if (it == this->slots.end())
+		return MatteCacheEntryPtr();
+
+	it->second.last_use = ++this->tick;
+
+	return it->second.entry;
+}
+
+template<typename K> MatteCacheEntryPtr
+MatteCacheT<K>::findNear(K key, K tolerance)
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	auto dist = [key](K k) { return (k < key) ? (key - k) : (k - key); };
+	auto best = this->slots.end();
+
+	for (auto it = this->slots.lower_bound(key - tolerance);
+	     (it != this->slots.end()) && !(key + tolerance < it->first); it++)
+		if ((best == this->slots.end()) ||
+		    (dist(it->first) < dist(best->first)))
+			best = it;
+
+	if (best == this->slots.end())
+		return MatteCacheEntryPtr();
+
+	best->second.last_use = ++this->tick;
+
+	return best->second.entry;
+}
+
+template<typename K> void
+MatteCacheT<K>::evict()
+{
+	/* Linear scan for the oldest, there's a few hundred entries at most */
+	while (this->used > this->limit)
+	{
+		auto oldest = this->slots.begin();
+
+		for (auto it = this->slots.begin(); it != this->slots.end(); it++)
+			if (it->second.last_use < oldest->second.last_use)
+				oldest = it;
+
+		this->used -= oldest->second.entry->size();
+		this->slots.erase(oldest);
+	}
+}
+
+
+template class MatteCacheT<OfxTime>;
+template class MatteCacheT<uint64_t>;
@@ -0,0 +1,97 @@
+/*
+ * matte_cache.h
+ *
+ * vim: ts=8 sw=8
+ *
+ * Cache of model results, with the recurrent state following each frame
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "ofxCore.h"
+
+#include "backend.h"
+
+
+/* Model result of a frame. The state is a checkpoint : a sequence can go on
+ * from the next frame without the model having run on this one */
+struct MatteCacheEntry {
+	/* What it was computed with */
+	int profile;
+	double scale;
+	double downsample_ratio;	/* Setting, 0.0 for default */
+	OfxRectI frame;			/* Area the model could run on */
+	uint64_t hash;			/* Input content over 'frame' */
+	uint64_t key;			/* Everything the result depends on */
+
+	/* Result */
+	OfxRectI roi;			/* Canvas area of pha / fgr */
+	OfxRectI rect;			/* Canvas area covered by the (padded) input */
+	OfxRectI input_rect;		/* Input picture bounds */
+	PlanarImage pha;
+	PlanarImage fgr;		/* Empty if not computed */
+	BackendStatePtr state;
+
+	size_t size() const {
+		return (pha.data.size() + fgr.data.size()) * sizeof(float) +
+			(state ? state->size() : 0);
+	}
+};
+
+typedef std::shared_ptr<const MatteCacheEntry> MatteCacheEntryPtr;
+
+/* Result keys : what a result depends on (model, input, state it went on
+ * from, ...) is mixed in, starting from 0 */
+static inline uint64_t
+matteKeyMix(uint64_t key, uint64_t v)
+{
+	key ^= v * 0xc2b2ae3d27d4eb4fULL;
+	key = (key << 31) | (key >> 33);
+	return key * 0x9e3779b97f4a7c15ULL;
+}
+
+/* Entries by key, least recently used evicted first once over the size
+ * limit (mattes and states). Thread safe */
+template<typename K>
+class MatteCacheT {
+public:
+	MatteCacheT() : limit(0), used(0), tick(0), gen(0) {};
+
+	void setLimit(size_t bytes);
+	size_t getLimit() const { return this->limit; }
+
+	void clear();
+	unsigned generation() const { return this->gen; }	/* Bumped by each clear() */
+	void insert(K key, MatteCacheEntryPtr entry);
+	MatteCacheEntryPtr find(K key);
+	MatteCacheEntryPtr findNear(K key, K tolerance);	/* Closest one within tolerance (time keys) */
+
+private:
+	struct Slot {
+		MatteCacheEntryPtr entry;
+		uint64_t last_use;
+	};
+
+	void evict();
+
+	std::mutex lock;
+	std::map<K, Slot> slots;
+	size_t limit;
+	size_t used;
+	uint64_t tick;
+	std::atomic<unsigned> gen;
+};
+
+/* Results of an instance by time, and of all instances by result key */
+typedef MatteCacheT<OfxTime>  MatteCache;
+typedef MatteCacheT<uint64_t> SharedMatteCache;
@@ -0,0 +1,694 @@
+/*
+ * native_archive.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * Minimal reader for the tensors of TorchScript archives
+ *
+ * A TorchScript file is a zip archive (entries stored, not compressed)
+ * containing :
+ *   <name>/data.pkl  : the module attributes, pickle protocol 2
+ *   <name>/data/<N>  : the raw tensor storages, little endian
+ *   <name>/code/...  : the TorchScript code (ignored)
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "native_archive.h"
+
+
+/* ------------------------------------------------------------------------- */
+/* Helpers                                                                   */
+/* ------------------------------------------------------------------------- */
+
+static inline uint16_t rd16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static inline uint32_t rd32(const uint8_t *p) { return rd16(p) | ((uint32_t)rd16(p+2) << 16); }
+static inline uint64_t rd64(const uint8_t *p) { return rd32(p) | ((uint64_t)rd32(p+4) << 32); }
+
+static float
+halfToFloat(uint16_t h)
+{
+	uint32_t s = (uint32_t)(h & 0x8000) << 16;
+	uint32_t e = (h >> 10) & 0x1f;
+	uint32_t m = h & 0x3ff;
+	uint32_t f;
+	float r;
+
+	if (e == 0) {
+		if (m == 0) {
+			f = s;
+		} else {
+			/* Subnormal, normalize it */
+			e = 127 - 15 + 1;
+			while (!(m & 0x400)) {
+				m <<= 1;
+				e--;
+			}
+			f = s | (e << 23) | ((m & 0x3ff) << 13);
+		}
+	} else if (e == 31) {
+		f = s | 0x7f800000 | (m << 13);
+	} else {
+		f = s | ((e + 127 - 15) << 23) | (m << 13);
+	}
+
+	memcpy(&r, &f, sizeof(float));
+	return r;
+}
+
+static float
+bfloat16ToFloat(uint16_t h)
+{
+	uint32_t f = (uint32_t)h << 16;
+	float r;
+	memcpy(&r, &f, sizeof(float));
+	return r;
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Zip                                                                       */
+/* ------------------------------------------------------------------------- */
+
+struct ZipEntry {
+	size_t offset;
+	size_t size;
+};
+
+static void
+zipParse(std::map<std::string, ZipEntry> &entries, const uint8_t *buf, size_t len)
+{
+	/* Find End Of Central Directory record */
+	ptrdiff_t eocd = -1;
+
+	for (ptrdiff_t i=(ptrdiff_t)len-22; (i >= 0) && (i >= (ptrdiff_t)len-22-65535); i--) {
+		if (rd32(buf+i) == 0x06054b50) {
+			eocd = i;
+			break;
+		}
+	}
+
+	if (eocd < 0)
+		throw std::runtime_error("Not a zip archive");
+
+	uint64_t n_entries = rd16(buf + eocd + 10);
+	uint64_t cd_ofs    = rd32(buf + eocd + 16);
+
+	/* Zip64 */
+	if ((eocd >= 20) && (rd32(buf + eocd - 20) == 0x07064b50)) {
+		uint64_t z64 = rd64(buf + eocd - 20 + 8);
+
+		if ((z64 + 56 > len) || (rd32(buf + z64) != 0x06064b50))
+			throw std::runtime_error("Corrupted zip64 archive");
+
+		n_entries = rd64(buf + z64 + 32);
+		cd_ofs    = rd64(buf + z64 + 48);
+	}
+
+	/* Scan central directory */
+	uint64_t p = cd_ofs;
+
+	for (uint64_t i=0; i<n_entries; i++)
+	{
+		if ((p + 46 > len) || (rd32(buf + p) != 0x02014b50))
+			throw std::runtime_error("Corrupted zip central directory");
+
+		uint16_t method   = rd16(buf + p + 10);
+		uint64_t csize    = rd32(buf + p + 20);
+		uint64_t usize    = rd32(buf + p + 24);
+		uint16_t name_len = rd16(buf + p + 28);
+		uint16_t xtra_len = rd16(buf + p + 30);
+		uint16_t cmnt_len = rd16(buf + p + 32);
+		uint64_t lh_ofs   = rd32(buf + p + 42);
+
+		if (p + 46 + name_len + xtra_len > len)
+			throw std::runtime_error("Corrupted zip central directory");
+
+		std::string name((const char *)buf + p + 46, name_len);
+
+		/* Zip64 extended information (only present fields are stored) */
+		const uint8_t *x = buf + p + 46 + name_len;
+		const uint8_t *xe = x + xtra_len;
+
+		while (x + 4 <= xe) {
+			uint16_t id = rd16(x);
+			uint16_t sz = rd16(x + 2);
+			const uint8_t *d = x + 4;
+
+			if (id == 0x0001) {
+				if ((usize  == 0xffffffff) && (d + 8 <= x + 4 + sz)) { usize  = rd64(d); d += 8; }
+				if ((csize  == 0xffffffff) && (d + 8 <= x + 4 + sz)) { csize  = rd64(d); d += 8; }
+				if ((lh_ofs == 0xffffffff) && (d + 8 <= x + 4 + sz)) { lh_ofs = rd64(d); d += 8; }
+			}
+
+			x += 4 + sz;
+		}
+
+		/* Locate data using the local header (its extra field differs) */
+		if ((lh_ofs + 30 > len) || (rd32(buf + lh_ofs) != 0x04034b50))
+			throw std::runtime_error("Corrupted zip local header");
+
+		uint64_t data_ofs = lh_ofs + 30 + rd16(buf + lh_ofs + 26) + rd16(buf + lh_ofs + 28);
+
+		if (data_ofs + csize > len)
+			throw std::runtime_error("Truncated zip archive");
+
+		/* PyTorch never compresses, but be safe */
+		if ((method == 0) && (csize == usize))
+			entries[name] = ZipEntry { (size_t)data_ofs, (size_t)usize };
+
+		p += 46 + name_len + xtra_len + cmnt_len;
+	}
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Pickle                                                                    */
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Only what the TorchScript pickler produces is supported. Objects are
+ * kept as their class name + state, and calls (REDUCE) are only evaluated
+ * for the few torch helpers we care about.
+ */
+
+struct PickleValue;
+typedef std::shared_ptr<PickleValue> PickleRef;
+
+struct PickleValue {
+	enum kind {
+		NONE, BOOL, INT, FLOAT, STRING, TUPLE, LIST, DICT,
+		GLOBAL, OBJECT, STORAGE, TENSOR, OTHER,
+	} kind;
+
+	int64_t i;
+	double f;
+	std::string s;			/* STRING, GLOBAL/OBJECT name, STORAGE key */
+	std::string dtype;		/* STORAGE */
+	std::vector<PickleRef> items;	/* TUPLE, LIST, DICT (key, value, ...) */
+	PickleRef state;		/* OBJECT */
+
+	/* TENSOR */
+	PickleRef storage;
+	int64_t offset;
+	std::vector<int64_t> sizes, strides;
+
+	PickleValue(enum kind k) : kind(k), i(0), f(0.0), offset(0) {};
+};
+
+static PickleRef
+pickleNew(enum PickleValue::kind k)
+{
+	return std::make_shared<PickleValue>(k);
+}
+
+static PickleRef
+pickleBuildTensor(const PickleRef &args)
+{
+	/* storage, storage_offset, size, stride, requires_grad, backward_hooks [, metadata] */
+	if ((args->kind != PickleValue::TUPLE) || (args->items.size() < 4) ||
+	    (args->items[0]->kind != PickleValue::STORAGE))
+		throw std::runtime_error("Unsupported tensor in archive");
+
+	PickleRef t = pickleNew(PickleValue::TENSOR);
+
+	t->storage = args->items[0];
+	t->offset  = args->items[1]->i;
+
+	for (auto &v : args->items[2]->items)
+		t->sizes.push_back(v->i);
+	for (auto &v : args->items[3]->items)
+		t->strides.push_back(v->i);
+
+	return t;
+}
+
+static PickleRef
+pickleLoad(const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	std::vector<PickleRef> stack;
+	std::vector<size_t> marks;
+	std::vector<PickleRef> memo;
+
+	auto need = [&](size_t n) {
+		if ((size_t)(end - p) < n)
+			throw std::runtime_error("Truncated pickle");
+	};
+
+	auto pop = [&]() {
+		if (stack.empty())
+			throw std::runtime_error("Corrupted pickle (stack underflow)");
+		PickleRef v = stack.back();
+		stack.pop_back();
+		return v;
+	};
+
+	auto popMark = [&]() {
+		if (marks.empty() || (marks.back() > stack.size()))
+			throw std::runtime_error("Corrupted pickle (no mark)");
+		std::vector<PickleRef> items(stack.begin() + marks.back(), stack.end());
+		stack.resize(marks.back());
+		marks.pop_back();
+		return items;
+	};
+
+	auto memoPut = [&](size_t idx) {
+		if (stack.empty())
+			throw std::runtime_error("Corrupted pickle (stack underflow)");
+		if (memo.size() <= idx)
+			memo.resize(idx + 1);
+		memo[idx] = stack.back();
+	};
+
+	auto memoGet = [&](size_t idx) {
+		if ((idx >= memo.size()) || !memo[idx])
+			throw std::runtime_error("Corrupted pickle (bad memo)");
+		stack.push_back(memo[idx]);
+	};
+
+	auto pushString = [&](enum PickleValue::kind k, size_t n) {
+		need(n);
+		PickleRef v = pickleNew(k);
+		v->s.assign((const char *)p, n);
+		p += n;
+		stack.push_back(v);
+	};
+
+	auto readLine = [&]() {
+		const uint8_t *nl = (const uint8_t *)memchr(p, '\n', end - p);
+		if (!nl)
+			throw std::runtime_error("Truncated pickle");
+		std::string s((const char *)p, nl - p);
+		p = nl + 1;
+		return s;
+	};
+
+	while (true)
+	{
+		need(1);
+		uint8_t op = *p++;
+		PickleRef v;
+
+		switch (op) {
+		case 0x80:	/* PROTO */
+			need(1); p += 1;
+			break;
+		case 0x95:	/* FRAME */
+			need(8); p += 8;
+			break;
+
+		case '.':	/* STOP */
+			return pop();
+
+		/* Scalars */
+		case 'N':	/* NONE */
+			stack.push_back(pickleNew(PickleValue::NONE));
+			break;
+		case 0x88:	/* NEWTRUE */
+		case 0x89:	/* NEWFALSE */
+			v = pickleNew(PickleValue::BOOL);
+			v->i = (op == 0x88);
+			stack.push_back(v);
+			break;
+		case 'K':	/* BININT1 */
+			need(1);
+			v = pickleNew(PickleValue::INT);
+			v->i = p[0];
+			p += 1;
+			stack.push_back(v);
+			break;
+		case 'M':	/* BININT2 */
+			need(2);
+			v = pickleNew(PickleValue::INT);
+			v->i = rd16(p);
+			p += 2;
+			stack.push_back(v);
+			break;
+		case 'J':	/* BININT */
+			need(4);
+			v = pickleNew(PickleValue::INT);
+			v->i = (int32_t)rd32(p);
+			p += 4;
+			stack.push_back(v);
+			break;
+		case 0x8a: {	/* LONG1 */
+			need(1);
+			int n = *p++;
+			need(n);
+			if (n > 8)
+				throw std::runtime_error("Unsupported integer in pickle");
+			uint64_t u = 0;
+			for (int i=0; i<n; i++)
+				u |= (uint64_t)p[i] << (8*i);
+			if (n && (n < 8) && (p[n-1] & 0x80))
+				u |= ~0ULL << (8*n);
+			p += n;
+			v = pickleNew(PickleValue::INT);
+			v->i = (int64_t)u;
+			stack.push_back(v);
+			break;
+		}
+		case 'G': {	/* BINFLOAT (big endian) */
+			need(8);
+			uint64_t u = 0;
+			for (int i=0; i<8; i++)
+				u = (u << 8) | p[i];
+			p += 8;
+			v = pickleNew(PickleValue::FLOAT);
+			memcpy(&v->f, &u, sizeof(double));
+			stack.push_back(v);
+			break;
+		}
+
+		/* Strings */
+		case 'X':	/* BINUNICODE */
+		case 'B':	/* BINBYTES */
+			need(4); p += 4;
+			pushString(PickleValue::STRING, rd32(p-4));
+			break;
+		case 0x8c:	/* SHORT_BINUNICODE */
+		case 'C':	/* SHORT_BINBYTES */
+			need(1); p += 1;
+			pushString(PickleValue::STRING, p[-1]);
+			break;
+		case 0x8d:	/* BINUNICODE8 */
+			need(8); p += 8;
+			pushString(PickleValue::STRING, rd64(p-8));
+			break;
+
+		/* Containers */
+		case '(':	/* MARK */
+			marks.push_back(stack.size());
+			break;
+		case ')':	/* EMPTY_TUPLE */
+			stack.push_back(pickleNew(PickleValue::TUPLE));
+			break;
+		case 't':	/* TUPLE */
+			v = pickleNew(PickleValue::TUPLE);
+			v->items = popMark();
+			stack.push_back(v);
+			break;
+		case 0x85:	/* TUPLE1 */
+		case 0x86:	/* TUPLE2 */
+		case 0x87: {	/* TUPLE3 */
+			size_t n = op - 0x84;
+			if (stack.size() < n)
+				throw std::runtime_error("Corrupted pickle (stack underflow)");
+			v = pickleNew(PickleValue::TUPLE);
+			v->items.assign(stack.end() - n, stack.end());
+			stack.resize(stack.size() - n);
+			stack.push_back(v);
+			break;
+		}
+		case ']':	/* EMPTY_LIST */
+			stack.push_back(pickleNew(PickleValue::LIST));
+			break;
+		case '}':	/* EMPTY_DICT */
+			stack.push_back(pickleNew(PickleValue::DICT));
+			break;
+		case 'a':	/* APPEND */
+		case 's': {	/* SETITEM */
+			std::vector<PickleRef> items;
+			items.push_back(pop());
+			if (op == 's')
+				items.insert(items.begin(), pop());
+			if (stack.empty())
+				throw std::runtime_error("Corrupted pickle (stack underflow)");
+			stack.back()->items.insert(stack.back()->items.end(), items.begin(), items.end());
+			break;
+		}
+		case 'e':	/* APPENDS */
+		case 'u': {	/* SETITEMS */
+			std::vector<PickleRef> items = popMark();
+			if (stack.empty())
+				throw std::runtime_error("Corrupted pickle (stack underflow)");
+			stack.back()->items.insert(stack.back()->items.end(), items.begin(), items.end());
+			break;
+		}
+
+		/* Memo */
+		case 'q':	/* BINPUT */
+			need(1);
+			memoPut(p[0]);
+			p += 1;
+			break;
+		case 'r':	/* LONG_BINPUT */
+			need(4);
+			memoPut(rd32(p));
+			p += 4;
+			break;
+		case 0x94:	/* MEMOIZE */
+			memoPut(memo.size());
+			break;
+		case 'h':	/* BINGET */
+			need(1);
+			memoGet(p[0]);
+			p += 1;
+			break;
+		case 'j':	/* LONG_BINGET */
+			need(4);
+			memoGet(rd32(p));
+			p += 4;
+			break;
+
+		/* Objects */
+		case 'c': {	/* GLOBAL */
+			std::string module = readLine();
+			std::string name = readLine();
+			v = pickleNew(PickleValue::GLOBAL);
+			v->s = module + "." + name;
+			stack.push_back(v);
+			break;
+		}
+		case 0x93: {	/* STACK_GLOBAL */
+			PickleRef name = pop();
+			PickleRef module = pop();
+			v = pickleNew(PickleValue::GLOBAL);
+			v->s = module->s + "." + name->s;
+			stack.push_back(v);
+			break;
+		}
+		case 0x81: {	/* NEWOBJ */
+			pop();
+			PickleRef cls = pop();
+			v = pickleNew(PickleValue::OBJECT);
+			v->s = cls->s;
+			stack.push_back(v);
+			break;
+		}
+		case 'b': {	/* BUILD */
+			PickleRef state = pop();
+			if (stack.empty())
+				throw std::runtime_error("Corrupted pickle (stack underflow)");
+			if (stack.back()->kind == PickleValue::OBJECT)
+				stack.back()->state = state;
+			break;
+		}
+		case 'R': {	/* REDUCE */
+			PickleRef args = pop();
+			PickleRef fn = pop();
+
+			if (fn->s == "torch._utils._rebuild_tensor_v2") {
+				v = pickleBuildTensor(args);
+			} else if (!fn->s.compare(0, 17, "torch.jit._pickle") && !args->items.empty()) {
+				/* build_intlist & co, restore_type_tag : pass-through */
+				v = args->items[0];
+			} else {
+				v = pickleNew(PickleValue::OTHER);
+				v->s = fn->s;
+			}
+
+			stack.push_back(v);
+			break;
+		}
+		case 'Q': {	/* BINPERSID */
+			/* ('storage', torch.<Type>Storage, key, location, numel) */
+			PickleRef pid = pop();
+			if ((pid->kind != PickleValue::TUPLE) || (pid->items.size() < 3) ||
+			    (pid->items[1]->kind != PickleValue::GLOBAL))
+				throw std::runtime_error("Unsupported persistent id in archive");
+			v = pickleNew(PickleValue::STORAGE);
+			v->dtype = pid->items[1]->s;
+			v->s = pid->items[2]->s;
+			stack.push_back(v);
+			break;
+		}
+
+		default: {
+			char msg[64];
+			snprintf(msg, sizeof(msg), "Unsupported pickle opcode 0x%02x", op);
+			throw std::runtime_error(msg);
+		}
+		}
+	}
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Tensors                                                                   */
+/* ------------------------------------------------------------------------- */
+
+struct ArchiveCtx {
+	const uint8_t *buf;
+	std::map<std::string, ZipEntry> entries;
+	std::string prefix;
+	Archive *archive;
+};
+
+static bool
+hostIsLittleEndian()
+{
+	const uint16_t v = 1;
+	return *(const uint8_t *)&v == 1;
+}
+
+static void
+loadTensor(ArchiveCtx &ctx, const std::string &name, const PickleValue &t)
+{
+	const std::string &dtype = t.storage->dtype;
+	size_t esize;
+
+	if (dtype == "torch.FloatStorage")
+		esize = 4;
+	else if ((dtype == "torch.HalfStorage") || (dtype == "torch.BFloat16Storage"))
+		esize = 2;
+	else	/* Integer buffers (num_batches_tracked, ...) are of no use */
+		return;
+
+	auto it = ctx.entries.find(ctx.prefix + "data/" + t.storage->s);
+	if (it == ctx.entries.end())
+		throw std::runtime_error("Missing storage for tensor " + name);
+
+	const uint8_t *data = ctx.buf + it->second.offset;
+	size_t numel = 1;
+
+	if (t.sizes.size() != t.strides.size())
+		throw std::runtime_error("Invalid tensor " + name);
+
+	/* Check bounds (largest element offset) */
+	int64_t last = t.offset;
+	for (size_t d=0; d<t.sizes.size(); d++) {
+		numel *= t.sizes[d];
+		last += (t.sizes[d] - 1) * t.strides[d];
+	}
+
+	if (numel && (((size_t)last + 1) * esize > it->second.size))
+		throw std::runtime_error("Truncated storage for tensor " + name);
+
+	ArchiveTensor &dst = ctx.archive->tensors[name];
+	dst.sizes = t.sizes;
+	dst.mapped = nullptr;
+
+	/* Use float32 data in place if possible */
+	bool contiguous = true;
+	int64_t stride = 1;
+
+	for (ptrdiff_t d=(ptrdiff_t)t.sizes.size()-1; d>=0; d--) {
+		if ((t.sizes[d] != 1) && (t.strides[d] != stride))
+			contiguous = false;
+		stride *= t.sizes[d];
+	}
+
+	if ((dtype == "torch.FloatStorage") && contiguous && hostIsLittleEndian() &&
+	    !(((uintptr_t)data + t.offset * esize) & (sizeof(float) - 1))) {
+		dst.mapped = (const float *)(data + t.offset * esize);
+		return;
+	}
+
+	dst.converted.resize(numel);
+
+	/* Gather, in case the tensor isn't contiguous */
+	std::vector<int64_t> idx(t.sizes.size(), 0);
+
+	for (size_t i=0; i<numel; i++)
+	{
+		int64_t o = t.offset;
+		for (size_t d=0; d<idx.size(); d++)
+			o += idx[d] * t.strides[d];
+
+		const uint8_t *e = data + o * esize;
+
+		if (esize == 4) {
+			uint32_t u = rd32(e);
+			memcpy(&dst.converted[i], &u, sizeof(float));
+		} else if (dtype == "torch.HalfStorage") {
+			dst.converted[i] = halfToFloat(rd16(e));
+		} else {
+			dst.converted[i] = bfloat16ToFloat(rd16(e));
+		}
+
+		for (ptrdiff_t d=(ptrdiff_t)idx.size()-1; d>=0; d--) {
+			if (++idx[d] < t.sizes[d])
+				break;
+			idx[d] = 0;
+		}
+	}
+}
+
+static void
+collectTensors(ArchiveCtx &ctx, const std::string &prefix, const PickleRef &obj)
+{
+	if (!obj->state || (obj->state->kind != PickleValue::DICT))
+		return;
+
+	const std::vector<PickleRef> &items = obj->state->items;
+
+	for (size_t i=0; i+1<items.size(); i+=2)
+	{
+		const PickleRef &k = items[i];
+		const PickleRef &v = items[i+1];
+
+		if (k->kind != PickleValue::STRING)
+			continue;
+
+		if (v->kind == PickleValue::OBJECT)
+			collectTensors(ctx, prefix + k->s + ".", v);
+		else if (v->kind == PickleValue::TENSOR)
+			loadTensor(ctx, prefix + k->s, *v);
+	}
+}
+
+
+void
+archiveLoad(Archive &archive, const char *filename)
+{
+	ArchiveCtx ctx;
+
+	archive.file = std::make_shared<MappedFile>(filename);
+	archive.tensors.clear();
+
+	ctx.buf = archive.file->data();
+	ctx.archive = &archive;
+	zipParse(ctx.entries, ctx.buf, archive.file->size());
+
+	/* Find the top level data.pkl */
+	for (auto &e : ctx.entries) {
+		size_t sep = e.first.find('/');
+		if ((sep != std::string::npos) && (e.first.compare(sep, std::string::npos, "/data.pkl") == 0)) {
+			ctx.prefix = e.first.substr(0, sep + 1);
+			break;
+		}
+	}
+
+	auto pkl = ctx.entries.find(ctx.prefix + "data.pkl");
+	if (ctx.prefix.empty() || (pkl == ctx.entries.end()))
+		throw std::runtime_error("Not a TorchScript archive");
+
+	/* Load module and walk its attributes */
+	PickleRef root = pickleLoad(ctx.buf + pkl->second.offset, pkl->second.size);
+
+	if (root->kind != PickleValue::OBJECT)
+		throw std::runtime_error("Unexpected TorchScript archive content");
+
+	collectTensors(ctx, "", root);
+}
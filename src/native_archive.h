@@ -0,0 +1,41 @@
+/*
+ * native_archive.h
+ *
+ * vim: ts=8 sw=8
+ *
+ * Minimal reader for the tensors of TorchScript archives
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+
+struct ArchiveTensor {
+	std::vector<int64_t> sizes;
+
+	/* Contiguous float32 data, either straight from the mapped file or
+	 * converted at load */
+	const float *mapped;
+	std::vector<float> converted;
+
+	const float *data() const { return this->mapped ? this->mapped : this->converted.data(); }
+};
+
+struct Archive {
+	MappedFilePtr file;
+	std::map<std::string, ArchiveTensor> tensors;
+};
+
+/* Loads all tensor attributes of the module saved in a TorchScript
+ * archive, named like the state_dict() keys ("backbone.features.0.0.weight")
+ * Throws on error */
+void archiveLoad(Archive &archive, const char *filename);
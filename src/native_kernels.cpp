@@ -0,0 +1,701 @@
+/*
+ * native_kernels.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * Compute kernels of the native inference engine
+ *
+ * Everything operates on planar float32 images. The heavy lifting is
+ * done by a register blocked matrix product used for both pointwise
+ * convolutions and (through an im2col of a band of rows) the dense ones,
+ * depthwise convolutions have their own kernel. SIMD is picked at compile
+ * time (AVX2+FMA, SSE2, NEON or plain C).
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "native_kernels.h"
+
+
+/* ------------------------------------------------------------------------- */
+/* SIMD                                                                      */
+/* ------------------------------------------------------------------------- */
+
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+#include <immintrin.h>
+
+#define VL 8
+typedef __m256 vfloat;
+
+static inline vfloat vload(const float *p)          { return _mm256_loadu_ps(p); }
+static inline void   vstore(float *p, vfloat v)     { _mm256_storeu_ps(p, v); }
+static inline vfloat vset1(float v)                 { return _mm256_set1_ps(v); }
+static inline vfloat vfma(vfloat a, vfloat b, vfloat c) { return _mm256_fmadd_ps(a, b, c); }
+static inline vfloat vadd(vfloat a, vfloat b)       { return _mm256_add_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b)       { return _mm256_mul_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b)       { return _mm256_max_ps(a, b); }
+static inline vfloat vmin(vfloat a, vfloat b)       { return _mm256_min_ps(a, b); }
+
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+
+#define VL 4
+typedef __m128 vfloat;
+
+static inline vfloat vload(const float *p)          { return _mm_loadu_ps(p); }
+static inline void   vstore(float *p, vfloat v)     { _mm_storeu_ps(p, v); }
+static inline vfloat vset1(float v)                 { return _mm_set1_ps(v); }
+static inline vfloat vfma(vfloat a, vfloat b, vfloat c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+static inline vfloat vadd(vfloat a, vfloat b)       { return _mm_add_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b)       { return _mm_mul_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b)       { return _mm_max_ps(a, b); }
+static inline vfloat vmin(vfloat a, vfloat b)       { return _mm_min_ps(a, b); }
+
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define VL 4
+typedef float32x4_t vfloat;
+
+static inline vfloat vload(const float *p)          { return vld1q_f32(p); }
+static inline void   vstore(float *p, vfloat v)     { vst1q_f32(p, v); }
+static inline vfloat vset1(float v)                 { return vdupq_n_f32(v); }
+#if defined(__aarch64__)
+static inline vfloat vfma(vfloat a, vfloat b, vfloat c) { return vfmaq_f32(c, a, b); }
+#else
+static inline vfloat vfma(vfloat a, vfloat b, vfloat c) { return vmlaq_f32(c, a, b); }
+#endif
+static inline vfloat vadd(vfloat a, vfloat b)       { return vaddq_f32(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b)       { return vmulq_f32(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b)       { return vmaxq_f32(a, b); }
+static inline vfloat vmin(vfloat a, vfloat b)       { return vminq_f32(a, b); }
+
+#else
+
+#define VL 1
+typedef float vfloat;
+
+static inline vfloat vload(const float *p)          { return *p; }
+static inline void   vstore(float *p, vfloat v)     { *p = v; }
+static inline vfloat vset1(float v)                 { return v; }
+static inline vfloat vfma(vfloat a, vfloat b, vfloat c) { return a * b + c; }
+static inline vfloat vadd(vfloat a, vfloat b)       { return a + b; }
+static inline vfloat vmul(vfloat a, vfloat b)       { return a * b; }
+static inline vfloat vmax(vfloat a, vfloat b)       { return std::max(a, b); }
+static inline vfloat vmin(vfloat a, vfloat b)       { return std::min(a, b); }
+
+#endif
+
+
+/* ------------------------------------------------------------------------- */
+/* Threading                                                                 */
+/* ------------------------------------------------------------------------- */
+
+class ThreadPool {
+public:
+	ThreadPool();
+	~ThreadPool();
+
+	void run(int n, const std::function<void(int, int)> &fn);
+
+private:
+	void worker();
+	void work();
+
+	std::vector<std::thread> threads;
+	std::mutex busy;		/* One job at a time */
+	std::mutex lock;
+	std::condition_variable cv_start, cv_done;
+	bool quit;
+	unsigned generation;
+	int active;
+
+	/* Current job */
+	const std::function<void(int, int)> *job_fn;
+	int job_n, job_chunk, job_chunks;
+	std::atomic<int> job_next;
+};
+
+ThreadPool::ThreadPool() :
+	quit(false), generation(0), active(0),
+	job_fn(nullptr), job_n(0), job_chunk(0), job_chunks(0), job_next(0)
+{
+	unsigned n = std::thread::hardware_concurrency();
+
+	/* The calling thread also takes part */
+	for (unsigned i=1; i<n; i++)
+		this->threads.emplace_back(&ThreadPool::worker, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> l(this->lock);
+		this->quit = true;
+	}
+	this->cv_start.notify_all();
+
+	for (auto &t : this->threads)
+		t.join();
+}
+
+void
+ThreadPool::work()
+{
+	int c;
+
+	while ((c = this->job_next.fetch_add(1)) < this->job_chunks) {
+		int b = c * this->job_chunk;
+		(*this->job_fn)(b, std::min(b + this->job_chunk, this->job_n));
+	}
+}
+
+void
+ThreadPool::worker()
+{
+	std::unique_lock<std::mutex> l(this->lock);
+	unsigned seen = 0;
+
+	while (true)
+	{
+		this->cv_start.wait(l, [&]{ return this->quit || (this->generation != seen); });
+		if (this->quit)
+			return;
+		seen = this->generation;
+
+		l.unlock();
+		this->work();
+		l.lock();
+
+		if (--this->active == 0)
+			this->cv_done.notify_all();
+	}
+}
+
+void
+ThreadPool::run(int n, const std::function<void(int, int)> &fn)
+{
+	/* Run inline if there is nothing to share or if the pool is already
+	 * used by another render thread */
+	if ((n <= 1) || this->threads.empty() || !this->busy.try_lock()) {
+		fn(0, n);
+		return;
+	}
+
+	int nthreads = this->threads.size() + 1;
+
+	{
+		std::lock_guard<std::mutex> l(this->lock);
+		this->job_fn = &fn;
+		this->job_n = n;
+		this->job_chunk = std::max(1, n / (4 * nthreads));
+		this->job_chunks = (n + this->job_chunk - 1) / this->job_chunk;
+		this->job_next = 0;
+		this->active = this->threads.size();
+		this->generation++;
+	}
+	this->cv_start.notify_all();
+
+	this->work();
+
+	{
+		std::unique_lock<std::mutex> l(this->lock);
+		this->cv_done.wait(l, [&]{ return this->active == 0; });
+	}
+
+	this->busy.unlock();
+}
+
+void
+nativeParallelFor(int n, const std::function<void(int, int)> &fn)
+{
+	static ThreadPool pool;
+	pool.run(n, fn);
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Activations                                                               */
+/* ------------------------------------------------------------------------- */
+
+void
+nativeActivate(float *p, size_t n, enum nativeActivation act)
+{
+	const vfloat zero = vset1(0.0f);
+	const vfloat three = vset1(3.0f);
+	const vfloat six = vset1(6.0f);
+	const vfloat sixth = vset1(1.0f / 6.0f);
+	size_t i = 0;
+
+	switch (act) {
+	case ACT_NONE:
+		break;
+
+	case ACT_RELU:
+		for (; i+VL<=n; i+=VL)
+			vstore(p+i, vmax(vload(p+i), zero));
+		for (; i<n; i++)
+			p[i] = std::max(p[i], 0.0f);
+		break;
+
+	case ACT_HARDSWISH:
+		/* x * relu6(x + 3) / 6 */
+		for (; i+VL<=n; i+=VL) {
+			vfloat x = vload(p+i);
+			vfloat r = vmin(vmax(vadd(x, three), zero), six);
+			vstore(p+i, vmul(vmul(x, r), sixth));
+		}
+		for (; i<n; i++)
+			p[i] = p[i] * std::min(std::max(p[i] + 3.0f, 0.0f), 6.0f) * (1.0f / 6.0f);
+		break;
+
+	case ACT_HARDSIGMOID:
+		/* relu6(x + 3) / 6 */
+		for (; i+VL<=n; i+=VL) {
+			vfloat x = vload(p+i);
+			vstore(p+i, vmul(vmin(vmax(vadd(x, three), zero), six), sixth));
+		}
+		for (; i<n; i++)
+			p[i] = std::min(std::max(p[i] + 3.0f, 0.0f), 6.0f) * (1.0f / 6.0f);
+		break;
+
+	case ACT_SIGMOID:
+		for (; i<n; i++)
+			p[i] = 1.0f / (1.0f + expf(-p[i]));
+		break;
+
+	case ACT_TANH:
+		for (; i<n; i++)
+			p[i] = tanhf(p[i]);
+		break;
+	}
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Matrix product                                                            */
+/* ------------------------------------------------------------------------- */
+
+/*
+ * out[o * ldo + j] = bias[o] + scale[o] * sum_i w[o * ldw + i] * in[i * ldi + j]
+ *
+ * for o in [0, m), j in [0, n). Blocks of 4 outputs x 2 vectors are kept
+ * in registers while walking the reduction dimension. Strips of input
+ * columns are the outer loop so they stay in cache for all the outputs.
+ */
+static inline void
+gemmBlock4(float *out, size_t ldo, const float *w, size_t ldw,
+	   const float *scale, const float *bias, const float *in, size_t ldi, int k, int j, int n)
+{
+	const float *w0 = w;
+	const float *w1 = w + ldw;
+	const float *w2 = w + 2 * ldw;
+	const float *w3 = w + 3 * ldw;
+
+	if (n == 2*VL)
+	{
+		vfloat a00 = vset1(0.0f), a01 = a00;
+		vfloat a10 = a00, a11 = a00;
+		vfloat a20 = a00, a21 = a00;
+		vfloat a30 = a00, a31 = a00;
+		const float *p = in + j;
+
+		for (int i=0; i<k; i++, p+=ldi) {
+			vfloat x0 = vload(p);
+			vfloat x1 = vload(p + VL);
+			vfloat c;
+			c = vset1(w0[i]); a00 = vfma(c, x0, a00); a01 = vfma(c, x1, a01);
+			c = vset1(w1[i]); a10 = vfma(c, x0, a10); a11 = vfma(c, x1, a11);
+			c = vset1(w2[i]); a20 = vfma(c, x0, a20); a21 = vfma(c, x1, a21);
+			c = vset1(w3[i]); a30 = vfma(c, x0, a30); a31 = vfma(c, x1, a31);
+		}
+
+		vfloat s, b;
+		s = vset1(scale[0]); b = vset1(bias[0]);
+		vstore(out + j, vfma(s, a00, b));         vstore(out + j + VL, vfma(s, a01, b));
+		s = vset1(scale[1]); b = vset1(bias[1]);
+		vstore(out + ldo + j, vfma(s, a10, b));   vstore(out + ldo + j + VL, vfma(s, a11, b));
+		s = vset1(scale[2]); b = vset1(bias[2]);
+		vstore(out + 2*ldo + j, vfma(s, a20, b)); vstore(out + 2*ldo + j + VL, vfma(s, a21, b));
+		s = vset1(scale[3]); b = vset1(bias[3]);
+		vstore(out + 3*ldo + j, vfma(s, a30, b)); vstore(out + 3*ldo + j + VL, vfma(s, a31, b));
+		return;
+	}
+
+	for (int jj=j; jj<j+n; jj++)
+	{
+		float a0 = 0.0f, a1 = 0.0f, a2 = 0.0f, a3 = 0.0f;
+		const float *p = in + jj;
+
+		for (int i=0; i<k; i++, p+=ldi) {
+			a0 += w0[i] * *p;
+			a1 += w1[i] * *p;
+			a2 += w2[i] * *p;
+			a3 += w3[i] * *p;
+		}
+
+		out[jj]         = a0 * scale[0] + bias[0];
+		out[ldo + jj]   = a1 * scale[1] + bias[1];
+		out[2*ldo + jj] = a2 * scale[2] + bias[2];
+		out[3*ldo + jj] = a3 * scale[3] + bias[3];
+	}
+}
+
+static inline void
+gemmBlock1(float *out, const float *w, float scale, float bias,
+	   const float *in, size_t ldi, int k, int j, int n)
+{
+	int jj = j;
+
+	for (; jj+VL<=j+n; jj+=VL) {
+		vfloat a = vset1(0.0f);
+		const float *p = in + jj;
+		for (int i=0; i<k; i++, p+=ldi)
+			a = vfma(vset1(w[i]), vload(p), a);
+		vstore(out + jj, vfma(vset1(scale), a, vset1(bias)));
+	}
+
+	for (; jj<j+n; jj++) {
+		float a = 0.0f;
+		const float *p = in + jj;
+		for (int i=0; i<k; i++, p+=ldi)
+			a += w[i] * *p;
+		out[jj] = a * scale + bias;
+	}
+}
+
+static void
+gemm(float *out, size_t ldo,
+     const float *w, size_t ldw, const float *scale, const float *bias,
+     const float *in, size_t ldi,
+     int m, int k, int n)
+{
+	for (int j=0; j<n; j+=2*VL)
+	{
+		int nj = std::min(2*VL, n - j);
+		int o = 0;
+
+		for (; o+4<=m; o+=4)
+			gemmBlock4(out + o * ldo, ldo, w + o * ldw, ldw, scale + o, bias + o, in, ldi, k, j, nj);
+
+		for (; o<m; o++)
+			gemmBlock1(out + o * ldo, w + o * ldw, scale[o], bias[o], in, ldi, k, j, nj);
+	}
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Convolutions                                                              */
+/* ------------------------------------------------------------------------- */
+
+/* Number of output pixels processed per parallel work item */
+#define PIXEL_BLOCK	256
+
+static void
+convPointwise(PlanarImage &out, const PlanarImage &in, const NativeConv &conv)
+{
+	size_t hw = (size_t)in.h * in.w;
+	int nblk = (hw + PIXEL_BLOCK - 1) / PIXEL_BLOCK;
+
+	nativeParallelFor(nblk, [&](int b0, int b1) {
+		size_t j0 = (size_t)b0 * PIXEL_BLOCK;
+		size_t j1 = std::min(hw, (size_t)b1 * PIXEL_BLOCK);
+
+		gemm(out.data.data() + j0, hw,
+		     conv.w, conv.cin, conv.scale.data(), conv.b.data(),
+		     in.data.data() + j0, hw,
+		     conv.cout, conv.cin, j1 - j0);
+
+		if (conv.act != ACT_NONE)
+			for (int o=0; o<conv.cout; o++)
+				nativeActivate(out.plane(o) + j0, j1 - j0, conv.act);
+	});
+}
+
+static void
+convDense(PlanarImage &out, const PlanarImage &in, const NativeConv &conv)
+{
+	int k = conv.k, s = conv.stride, p = conv.pad, d = conv.dilation;
+	int kk = conv.cin * k * k;
+	size_t ohw = (size_t)out.h * out.w;
+
+	/* Bands of output rows go through im2col then the matrix product */
+	int band = std::max(1, std::min(out.h, PIXEL_BLOCK / std::max(1, out.w)));
+	int nband = (out.h + band - 1) / band;
+
+	nativeParallelFor(nband, [&](int b0, int b1) {
+		std::vector<float> col((size_t)kk * band * out.w);
+
+		for (int b=b0; b<b1; b++)
+		{
+			int y0 = b * band;
+			int y1 = std::min(out.h, y0 + band);
+			size_t n = (size_t)(y1 - y0) * out.w;
+
+			/* im2col */
+			float *cp = col.data();
+
+			for (int ci=0; ci<conv.cin; ci++) {
+				const float *ip = in.plane(ci);
+
+				for (int ky=0; ky<k; ky++) {
+					for (int kx=0; kx<k; kx++) {
+						/* Output columns reading inside the image */
+						int ofs = kx * d - p;
+						int x0 = std::min(out.w, std::max(0, (-ofs + s - 1) / s));
+						int x1 = std::max(x0, std::min(out.w, (in.w - ofs + s - 1) / s));
+
+						for (int y=y0; y<y1; y++, cp+=out.w) {
+							int iy = y * s + ky * d - p;
+
+							if ((iy < 0) || (iy >= in.h)) {
+								memset(cp, 0x00, out.w * sizeof(float));
+								continue;
+							}
+
+							const float *ir = ip + (size_t)iy * in.w + ofs;
+
+							memset(cp, 0x00, x0 * sizeof(float));
+							memset(cp + x1, 0x00, (out.w - x1) * sizeof(float));
+
+							if (s == 1)
+								memcpy(cp + x0, ir + x0, (x1 - x0) * sizeof(float));
+							else
+								for (int x=x0; x<x1; x++)
+									cp[x] = ir[x * s];
+						}
+					}
+				}
+			}
+
+			/* Product */
+			float *op = out.data.data() + (size_t)y0 * out.w;
+
+			gemm(op, ohw,
+			     conv.w, kk, conv.scale.data(), conv.b.data(),
+			     col.data(), n,
+			     conv.cout, kk, n);
+
+			if (conv.act != ACT_NONE)
+				for (int o=0; o<conv.cout; o++)
+					nativeActivate(op + o * ohw, n, conv.act);
+		}
+	});
+}
+
+static void
+convDepthwise(PlanarImage &out, const PlanarImage &in, const NativeConv &conv)
+{
+	int k = conv.k, s = conv.stride, p = conv.pad, d = conv.dilation;
+	int ph = in.h + 2 * p;
+	int pw = in.w + 2 * p;
+
+	nativeParallelFor(conv.cout, [&](int c0, int c1) {
+		/* Zero padded copy of the input plane avoids all bound checks */
+		std::vector<float> pad((size_t)ph * pw, 0.0f);
+
+		for (int c=c0; c<c1; c++)
+		{
+			const float *w = conv.w + (size_t)c * k * k;
+			const float *ip = in.plane(c);
+			float *op = out.plane(c);
+
+			for (int y=0; y<in.h; y++)
+				memcpy(&pad[(size_t)(y + p) * pw + p], ip + (size_t)y * in.w, in.w * sizeof(float));
+
+			for (int y=0; y<out.h; y++)
+			{
+				float *orow = op + (size_t)y * out.w;
+				int x;
+
+				for (x=0; x<out.w; x++)
+					orow[x] = conv.b[c];
+
+				for (int ky=0; ky<k; ky++) {
+					for (int kx=0; kx<k; kx++) {
+						const float *irow = &pad[(size_t)(y * s + ky * d) * pw + kx * d];
+						float wv = w[ky * k + kx] * conv.scale[c];
+
+						if (s == 1) {
+							vfloat vw = vset1(wv);
+							for (x=0; x+VL<=out.w; x+=VL)
+								vstore(orow + x, vfma(vw, vload(irow + x), vload(orow + x)));
+							for (; x<out.w; x++)
+								orow[x] += wv * irow[x];
+						} else {
+							for (x=0; x<out.w; x++)
+								orow[x] += wv * irow[x * s];
+						}
+					}
+				}
+
+				nativeActivate(orow, out.w, conv.act);
+			}
+		}
+	});
+}
+
+void
+nativeConv(PlanarImage &out, const PlanarImage &in, const NativeConv &conv)
+{
+	if (in.c != conv.cin)
+		throw std::runtime_error("Convolution input channel mismatch");
+
+	int oh = (in.h + 2 * conv.pad - conv.dilation * (conv.k - 1) - 1) / conv.stride + 1;
+	int ow = (in.w + 2 * conv.pad - conv.dilation * (conv.k - 1) - 1) / conv.stride + 1;
+
+	out = PlanarImage(conv.cout, oh, ow);
+
+	if (conv.groups == 1) {
+		if ((conv.k == 1) && (conv.stride == 1) && (conv.pad == 0))
+			convPointwise(out, in, conv);
+		else
+			convDense(out, in, conv);
+	} else if ((conv.groups == conv.cin) && (conv.groups == conv.cout)) {
+		convDepthwise(out, in, conv);
+	} else {
+		throw std::runtime_error("Unsupported grouped convolution");
+	}
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Resampling                                                                */
+/* ------------------------------------------------------------------------- */
+
+struct ResampleIndex {
+	int i0, i1;
+	float l0, l1;
+};
+
+static std::vector<ResampleIndex>
+resampleIndices(int in_size, int out_size, double scale)
+{
+	std::vector<ResampleIndex> idx(out_size);
+
+	/* Same as PyTorch upsample_bilinear2d (align_corners=False) */
+	if (scale <= 0.0)
+		scale = (double)in_size / out_size;
+
+	for (int i=0; i<out_size; i++) {
+		float src = std::max(0.0f, (float)scale * (i + 0.5f) - 0.5f);
+		int i0 = std::min((int)src, in_size - 1);
+		idx[i].i0 = i0;
+		idx[i].i1 = (i0 < in_size - 1) ? i0 + 1 : i0;
+		idx[i].l1 = src - i0;
+		idx[i].l0 = 1.0f - idx[i].l1;
+	}
+
+	return idx;
+}
+
+void
+nativeResize(PlanarImage &out, const PlanarImage &in, int h, int w, double scale_h, double scale_w)
+{
+	auto iy = resampleIndices(in.h, h, scale_h);
+	auto ix = resampleIndices(in.w, w, scale_w);
+
+	out = PlanarImage(in.c, h, w);
+
+	nativeParallelFor(in.c * h, [&](int r0, int r1) {
+		std::vector<float> tmp(in.w);
+
+		for (int r=r0; r<r1; r++)
+		{
+			int c = r / h, y = r % h;
+			const float *a = in.plane(c) + (size_t)iy[y].i0 * in.w;
+			const float *b = in.plane(c) + (size_t)iy[y].i1 * in.w;
+			float *o = out.plane(c) + (size_t)y * w;
+			vfloat la = vset1(iy[y].l0);
+			vfloat lb = vset1(iy[y].l1);
+			int x = 0;
+
+			/* Vertical pass */
+			for (; x+VL<=in.w; x+=VL)
+				vstore(&tmp[x], vfma(vload(a + x), la, vmul(vload(b + x), lb)));
+			for (; x<in.w; x++)
+				tmp[x] = a[x] * iy[y].l0 + b[x] * iy[y].l1;
+
+			/* Horizontal pass */
+			for (x=0; x<w; x++)
+				o[x] = tmp[ix[x].i0] * ix[x].l0 + tmp[ix[x].i1] * ix[x].l1;
+		}
+	});
+}
+
+void
+nativeAvgPool2(PlanarImage &out, const PlanarImage &in)
+{
+	int oh = (in.h + 1) / 2;
+	int ow = (in.w + 1) / 2;
+
+	out = PlanarImage(in.c, oh, ow);
+
+	for (int c=0; c<in.c; c++) {
+		for (int y=0; y<oh; y++) {
+			const float *a = in.plane(c) + (size_t)(2 * y) * in.w;
+			const float *b = (2 * y + 1 < in.h) ? a + in.w : nullptr;
+			float *o = out.plane(c) + (size_t)y * ow;
+
+			for (int x=0; x<ow; x++) {
+				int x0 = 2 * x, x1 = 2 * x + 1;
+				float sum = a[x0];
+				int n = 1;
+
+				if (x1 < in.w) { sum += a[x1]; n++; }
+				if (b) {
+					sum += b[x0]; n++;
+					if (x1 < in.w) { sum += b[x1]; n++; }
+				}
+
+				o[x] = sum / n;
+			}
+		}
+	}
+}
+
+void
+nativeChannelMean(PlanarImage &out, const PlanarImage &in)
+{
+	size_t hw = (size_t)in.h * in.w;
+
+	out = PlanarImage(in.c, 1, 1);
+
+	for (int c=0; c<in.c; c++) {
+		const float *p = in.plane(c);
+		double sum = 0.0;
+		for (size_t i=0; i<hw; i++)
+			sum += p[i];
+		out.data[c] = sum / hw;
+	}
+}
+
+void
+nativeConcat(PlanarImage &out, const std::vector<const PlanarImage *> &in)
+{
+	int h = in[0]->h, w = in[0]->w, c = 0;
+
+	for (const PlanarImage *i : in) {
+		h = std::min(h, i->h);
+		w = std::min(w, i->w);
+		c += i->c;
+	}
+
+	out = PlanarImage(c, h, w);
+	c = 0;
+
+	for (const PlanarImage *i : in)
+		for (int ic=0; ic<i->c; ic++, c++)
+			for (int y=0; y<h; y++)
+				memcpy(out.plane(c) + (size_t)y * w, i->plane(ic) + (size_t)y * i->w, w * sizeof(float));
+}
@@ -0,0 +1,72 @@
+/*
+ * native_kernels.h
+ *
+ * vim: ts=8 sw=8
+ *
+ * Compute kernels of the native inference engine
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include "backend.h"
+
+
+/* ------------------------------------------------------------------------- */
+/* Threading                                                                 */
+/* ------------------------------------------------------------------------- */
+
+/* Run fn(begin, end) over sub-ranges of [0, n) on the worker pool */
+void nativeParallelFor(int n, const std::function<void(int, int)> &fn);
+
+
+/* ------------------------------------------------------------------------- */
+/* Layers                                                                    */
+/* ------------------------------------------------------------------------- */
+
+enum nativeActivation {
+	ACT_NONE,
+	ACT_RELU,
+	ACT_HARDSWISH,
+	ACT_HARDSIGMOID,
+	ACT_SIGMOID,
+	ACT_TANH,
+};
+
+/* 2D convolution with BatchNorm applied as a per output scale and bias,
+ * which leaves the weights untouched so they can be used straight from the
+ * mapped model file. Only groups == 1 and depthwise (groups == cin == cout)
+ * are supported */
+struct NativeConv {
+	int cin, cout;
+	int k, stride, pad, dilation, groups;
+	enum nativeActivation act;
+	const float *w;			/* [cout][cin/groups][k][k] */
+	std::vector<float> scale;	/* [cout] */
+	std::vector<float> b;		/* [cout] */
+};
+
+void nativeConv(PlanarImage &out, const PlanarImage &in, const NativeConv &conv);
+
+/* In place activation */
+void nativeActivate(float *p, size_t n, enum nativeActivation act);
+
+/* Bilinear resize (align_corners=False). 'scale' is the input / output
+ * size ratio, or 0.0 to compute it from the sizes */
+void nativeResize(PlanarImage &out, const PlanarImage &in, int h, int w,
+	double scale_h, double scale_w);
+
+/* AvgPool2d(2, 2, ceil_mode=True, count_include_pad=False) */
+void nativeAvgPool2(PlanarImage &out, const PlanarImage &in);
+
+/* Per channel mean (adaptive average pooling to 1x1) */
+void nativeChannelMean(PlanarImage &out, const PlanarImage &in);
+
+/* Concatenation along the channels, inputs are cropped to the smallest one */
+void nativeConcat(PlanarImage &out, const std::vector<const PlanarImage *> &in);
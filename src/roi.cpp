@@ -0,0 +1,279 @@
+/*
+ * roi.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * Region of interest : crop selection and recurrent state remapping
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "roi.h"
+
+
+/* Crop origin / size alignment. At the usual 0.25 ratio this keeps the
+ * moves of the crop an integer number of pixels for all state levels */
+#define ROI_ALIGN	64
+
+/* Minimum margin around the subject */
+#define ROI_MARGIN_MIN	32
+
+/* Subject detection : alpha threshold, minimum peak alpha to trust the
+ * result, and distance to a crop side considered touching it */
+#define ROI_ALPHA_THRESHOLD	0.1f
+#define ROI_ALPHA_CONFIDENCE	0.5f
+#define ROI_EDGE		2
+
+
+/* ------------------------------------------------------------------------- */
+/* Crop selection                                                            */
+/* ------------------------------------------------------------------------- */
+
+static OfxRectI
+rectExpand(const OfxRectI &r, int m)
+{
+	return OfxRectI{ r.x1 - m, r.y1 - m, r.x2 + m, r.y2 + m };
+}
+
+static bool
+rectContains(const OfxRectI &a, const OfxRectI &b)
+{
+	return (b.x1 >= a.x1) && (b.y1 >= a.y1) && (b.x2 <= a.x2) && (b.y2 <= a.y2);
+}
+
+static double
+rectArea(const OfxRectI &r)
+{
+	return roiEmpty(r) ? 0.0 : (double)(r.x2 - r.x1) * (r.y2 - r.y1);
+}
+
+static int
+alignDown(int v, int o)
+{
+	return o + (int)floor((double)(v - o) / ROI_ALIGN) * ROI_ALIGN;
+}
+
+static int
+alignUp(int v, int o)
+{
+	return o + (int)ceil((double)(v - o) / ROI_ALIGN) * ROI_ALIGN;
+}
+
+bool
+roiSelect(OfxRectI &roi, const OfxRectI &bbox, const OfxRectI &frame)
+{
+	int margin = std::max(ROI_MARGIN_MIN, std::max(bbox.x2 - bbox.x1, bbox.y2 - bbox.y1) / 8);
+
+	/* Ideal crop : box with margin, aligned on the frame origin */
+	OfxRectI want = rectExpand(bbox, margin);
+
+	want.x1 = alignDown(want.x1, frame.x1);
+	want.y1 = alignDown(want.y1, frame.y1);
+	want.x2 = alignUp(want.x2, frame.x1);
+	want.y2 = alignUp(want.y2, frame.y1);
+
+	want = roiIntersect(want, frame);
+
+	/* Current one is fine if it has at least half the margin and isn't
+	 * much larger than needed */
+	OfxRectI need = roiIntersect(rectExpand(bbox, margin / 2), frame);
+
+	if (!roiEmpty(roi) && rectContains(frame, roi) && rectContains(roi, need) &&
+	    (rectArea(roi) <= 2.0 * rectArea(want)))
+		return false;
+
+	if (roiEqual(roi, want))
+		return false;
+
+	roi = want;
+
+	return true;
+}
+
+bool
+roiAlphaBounds(OfxRectI &bbox, const PlanarImage &pha, const OfxRectI &roi)
+{
+	int w = std::min(pha.w, roi.x2 - roi.x1);
+	int h = std::min(pha.h, roi.y2 - roi.y1);
+	int x1 = w, x2 = 0, y1 = h, y2 = 0;
+	float peak = 0.0f;
+
+	for (int y=0; y<h; y++)
+	{
+		const float *row = pha.plane(0) + (size_t)y * pha.w;
+		int rx1 = -1, rx2 = 0;
+
+		for (int x=0; x<w; x++) {
+			if (row[x] > ROI_ALPHA_THRESHOLD) {
+				if (rx1 < 0)
+					rx1 = x;
+				rx2 = x + 1;
+			}
+			peak = std::max(peak, row[x]);
+		}
+
+		if (rx1 < 0)
+			continue;
+
+		x1 = std::min(x1, rx1);
+		x2 = std::max(x2, rx2);
+		y1 = std::min(y1, y);
+		y2 = y + 1;
+	}
+
+	if ((x2 <= x1) || (peak < ROI_ALPHA_CONFIDENCE))
+		return false;
+
+	bbox = OfxRectI{ roi.x1 + x1, roi.y1 + y1, roi.x1 + x2, roi.y1 + y2 };
+
+	return true;
+}
+
+bool
+roiClipped(const OfxRectI &bbox, const OfxRectI &roi, const OfxRectI &frame)
+{
+	return  ((roi.x1 > frame.x1) && (bbox.x1 - ROI_EDGE <= roi.x1)) ||
+		((roi.y1 > frame.y1) && (bbox.y1 - ROI_EDGE <= roi.y1)) ||
+		((roi.x2 < frame.x2) && (bbox.x2 + ROI_EDGE >= roi.x2)) ||
+		((roi.y2 < frame.y2) && (bbox.y2 + ROI_EDGE >= roi.y2));
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* State remapping                                                           */
+/* ------------------------------------------------------------------------- */
+
+/* State sizes for a h x w input : the model downsamples the input by
+ * 'ratio' and each level then halves it (rounding up) */
+static void
+stateSizes(int sizes[4][2], int h, int w, double ratio)
+{
+	int sh = (int)floor(h * ratio);
+	int sw = (int)floor(w * ratio);
+
+	for (int i=0; i<4; i++) {
+		sh = (sh + 1) / 2;
+		sw = (sw + 1) / 2;
+		sizes[i][0] = sh;
+		sizes[i][1] = sw;
+	}
+}
+
+struct RemapTap {
+	int i0;
+	float w0, w1;	/* weights of i0 and i0+1, zero if outside */
+};
+
+static std::vector<RemapTap>
+remapTaps(int n_out, int o_out, int len_out, int n_in, double o_in, double len_in)
+{
+	/* Output pixel centers in canvas coordinates, back to input pixels */
+	std::vector<RemapTap> taps(n_out);
+	double so = (double)len_out / n_out;
+	double si = (double)n_in / len_in;
+
+	for (int i=0; i<n_out; i++) {
+		double c = o_out + (i + 0.5) * so;
+		double s = (c - o_in) * si - 0.5;
+		int i0 = (int)floor(s);
+		float f = (float)(s - i0);
+
+		taps[i].i0 = i0;
+		taps[i].w0 = ((i0 >= 0) && (i0 < n_in)) ? (1.0f - f) : 0.0f;
+		taps[i].w1 = ((i0 + 1 >= 0) && (i0 + 1 < n_in)) ? f : 0.0f;
+	}
+
+	return taps;
+}
+
+/* Area 'r' of the picture 'a' at the same place in the picture 'b' */
+static void
+rescaleRange(double &o, double &len, int r1, int r2, int a1, int a2, int b1, int b2)
+{
+	double s = (double)(b2 - b1) / (a2 - a1);
+
+	o   = b1 + (r1 - a1) * s;
+	len = (r2 - r1) * s;
+}
+
+static void
+remapPlane(PlanarImage &out, const PlanarImage &in,
+	const OfxRectI &from, const OfxRectI &from_frame,
+	const OfxRectI &to, const OfxRectI &to_frame)
+{
+	double fx, fw, fy, fh;
+
+	rescaleRange(fx, fw, from.x1, from.x2, from_frame.x1, from_frame.x2, to_frame.x1, to_frame.x2);
+	rescaleRange(fy, fh, from.y1, from.y2, from_frame.y1, from_frame.y2, to_frame.y1, to_frame.y2);
+
+	auto ty = remapTaps(out.h, to.y1, to.y2 - to.y1, in.h, fy, fh);
+	auto tx = remapTaps(out.w, to.x1, to.x2 - to.x1, in.w, fx, fw);
+
+	for (int c=0; c<out.c; c++)
+	{
+		const float *ip = in.plane(c);
+		float *op = out.plane(c);
+
+		for (int y=0; y<out.h; y++)
+		{
+			const RemapTap &t = ty[y];
+
+			for (int x=0; x<out.w; x++) {
+				const RemapTap &u = tx[x];
+				float v = 0.0f;
+
+				if (t.w0 != 0.0f) {
+					const float *r = ip + (size_t)t.i0 * in.w;
+					if (u.w0 != 0.0f) v += t.w0 * u.w0 * r[u.i0];
+					if (u.w1 != 0.0f) v += t.w0 * u.w1 * r[u.i0 + 1];
+				}
+
+				if (t.w1 != 0.0f) {
+					const float *r = ip + (size_t)(t.i0 + 1) * in.w;
+					if (u.w0 != 0.0f) v += t.w1 * u.w0 * r[u.i0];
+					if (u.w1 != 0.0f) v += t.w1 * u.w1 * r[u.i0 + 1];
+				}
+
+				*op++ = v;
+			}
+		}
+	}
+}
+
+bool
+roiRemapState(PlanarImage rn[4],
+	const OfxRectI &from, const OfxRectI &from_frame, double from_ratio,
+	const OfxRectI &to, const OfxRectI &to_frame, double to_ratio)
+{
+	int fh = from.y2 - from.y1, fw = from.x2 - from.x1;
+	int th = to.y2 - to.y1, tw = to.x2 - to.x1;
+
+	if ((fh <= 0) || (fw <= 0) || (th <= 0) || (tw <= 0) ||
+	    roiEmpty(from_frame) || roiEmpty(to_frame))
+		return false;
+
+	/* Check the state was produced with that ratio */
+	int sizes[4][2];
+
+	stateSizes(sizes, fh, fw, backendDownsampleRatio(from_ratio));
+
+	for (int i=0; i<4; i++)
+		if ((rn[i].h != sizes[i][0]) || (rn[i].w != sizes[i][1]))
+			return false;
+
+	/* Resample each level to the new geometry */
+	stateSizes(sizes, th, tw, backendDownsampleRatio(to_ratio));
+
+	for (int i=0; i<4; i++) {
+		PlanarImage out(rn[i].c, sizes[i][0], sizes[i][1]);
+		remapPlane(out, rn[i], from, from_frame, to, to_frame);
+		rn[i] = std::move(out);
+	}
+
+	return true;
+}
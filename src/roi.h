@@ -0,0 +1,65 @@
+/*
+ * roi.h
+ *
+ * vim: ts=8 sw=8
+ *
+ * Region of interest : crop selection and recurrent state remapping
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <algorithm>
+
+#include "ofxCore.h"
+
+#include "backend.h"
+
+
+static inline bool
+roiEqual(const OfxRectI &a, const OfxRectI &b)
+{
+	return (a.x1 == b.x1) && (a.y1 == b.y1) && (a.x2 == b.x2) && (a.y2 == b.y2);
+}
+
+static inline bool
+roiEmpty(const OfxRectI &r)
+{
+	return (r.x2 <= r.x1) || (r.y2 <= r.y1);
+}
+
+static inline OfxRectI
+roiIntersect(const OfxRectI &a, const OfxRectI &b)
+{
+	return OfxRectI{
+		std::max(a.x1, b.x1), std::max(a.y1, b.y1),
+		std::min(a.x2, b.x2), std::min(a.y2, b.y2)
+	};
+}
+
+/* Update the inference crop 'roi' (canvas coordinates, within 'frame') for
+ * a subject bounding box. The current crop is kept as long as it still fits
+ * the box well enough, to limit the state remaps and shape changes.
+ * Returns true if it changed */
+bool roiSelect(OfxRectI &roi, const OfxRectI &bbox, const OfxRectI &frame);
+
+/* Bounding box (canvas coordinates) of the subject in a model alpha output
+ * computed for the crop 'roi' (padding is ignored). Returns false if there
+ * is no subject, or if the model isn't confident enough about it */
+bool roiAlphaBounds(OfxRectI &bbox, const PlanarImage &pha, const OfxRectI &roi);
+
+/* Returns true if 'bbox' reaches one of the sides of the crop 'roi' that
+ * isn't a side of 'frame' too, i.e. the subject may extend beyond it */
+bool roiClipped(const OfxRectI &bbox, const OfxRectI &roi, const OfxRectI &frame);
+
+/* Remap recurrent state planes computed for an input covering the canvas
+ * area 'from' with the downsample ratio setting 'from_ratio' (0.0 for default)
+ * to an input covering 'to' with 'to_ratio'. If the input resolution
+ * changed, 'from_frame' / 'to_frame' are the picture bounds before and after
+ * and the state is scaled along. Areas not covered before are cold (zero).
+ * Returns false if the state geometry isn't understood */
+bool roiRemapState(PlanarImage rn[4],
+	const OfxRectI &from, const OfxRectI &from_frame, double from_ratio,
+	const OfxRectI &to, const OfxRectI &to_frame, double to_ratio);
@@ -9,15 +9,32 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
-
-#include <torch/script.h>
+#include <string>
+#include <thread>
 
 #include "ofxCore.h"
 #include "ofxImageEffect.h"
 #include "ofxPixels.h"
+#include "ofxProgress.h"
+
+#include "backend.h"
+#include "image.h"
+#include "mapped_file.h"
+#include "matte_cache.h"
+#include "roi.h"
 
 #if defined __APPLE__ || defined linux || defined __FreeBSD__
 #  define EXPORT OfxExport __attribute__((visibility("default")))
@@ -35,9 +52,16 @@ static OfxHost *		gHost;
 static OfxImageEffectSuiteV1 *	gEffectHost;
 static OfxPropertySuiteV1 *	gPropHost;
 static OfxParameterSuiteV1 *	gParamHost;
+static OfxProgressSuiteV1 *	gProgressHost;	/* Optional */
 
 static char *gBundlePath;
 
+/* Results shared by all instances, for nodes running the same model on the
+ * same frames. They only need to live until the other nodes got to them */
+#define SHARED_CACHE_SIZE	(256 << 20)
+
+static SharedMatteCache gSharedCache;
+
 
 
 /* ------------------------------------------------------------------------- */
@@ -47,12 +71,15 @@ static char *gBundlePath;
 enum deviceParamValue {
 	DEVICE_CPU = 0,
 	DEVICE_CUDA = 1,
+	DEVICE_ONNX_CPU = 2,
+	DEVICE_NATIVE_CPU = 3,
 };
 
 enum modelParamValue {
 	MODEL_MOBILENETV3 = 0,
 	MODEL_RESNET50 = 1,
 	MODEL_CUSTOM = 2,
+	MODEL_CUSTOM_AOT = 3,
 };
 
 enum modelPrecisionParamValue {
@@ -70,6 +97,74 @@ enum colorSourceParamValue {
 	COLOR_SRC_MODEL = 1,
 };
 
+enum shapeBucketingParamValue {
+	SHAPE_BUCKETING_OFF = 0,
+	SHAPE_BUCKETING_64  = 1,
+	SHAPE_BUCKETING_256 = 2,
+};
+
+enum modelProfile {
+	PROFILE_FINAL = 0,
+	PROFILE_INTERACTIVE = 1,
+	PROFILE_COUNT = 2,
+};
+
+
+/* Where a sequence of renders is at : recurrent state and crops */
+struct ModelCursor {
+	enum modelProfile profile;	/* What it's for */
+	double scale;
+	uint64_t last_use;
+
+	OfxTime rn_time;
+	OfxRectI rn_rect;	/* Canvas area covered by the (padded) input */
+	OfxRectI rn_input;	/* Input picture bounds */
+	double rn_downsample_ratio;
+	BackendStatePtr rn;
+	uint64_t rn_key;	/* Result it comes from */
+
+	OfxTime track_time;
+	OfxRectI track_bbox;	/* Subject found in the last result */
+	OfxRectI track_roi;	/* Subject tracking crop */
+	int track_frames;	/* Frames since the last full pass */
+
+	OfxRectI roi;		/* Garbage matte crop */
+
+	OfxTime hold_time;
+	MatteCacheEntryPtr hold;	/* Last result, for static frames ... */
+	std::vector<float> hold_sig;	/* ... with its input signature */
+	unsigned hold_gen;		/* Cache generation it's valid for */
+
+	ModelCursor() :
+		profile(PROFILE_FINAL), scale(1.0), last_use(0),
+		rn_time(nan("")), rn_rect{0,0,0,0}, rn_input{0,0,0,0}, rn_downsample_ratio(0.0), rn_key(0),
+		track_time(nan("")), track_bbox{0,0,0,0}, track_roi{0,0,0,0}, track_frames(0),
+		roi{0,0,0,0},
+		hold_time(nan("")), hold_gen(0)
+	{};
+};
+
+/* Model input / output of a frame. It's shared with the worker thread, so
+ * that it stays valid if the render gives up on it */
+struct ModelJob {
+	PlanarImage src;
+	BackendForward fwd;
+	std::atomic<bool> cancel{false};
+	std::atomic<bool> done{false};
+};
+
+typedef std::shared_ptr<ModelJob> ModelJobPtr;
+
+/* Worker thread running a job */
+struct ModelWorker {
+	std::thread thread;
+	ModelJobPtr job;
+	const Backend *backend = nullptr;
+};
+
+/* Sequences kept per instance, for hosts interleaving several renders
+ * streams (e.g. viewer playback and a background render) */
+#define MODEL_CURSORS	4
 
 struct InstanceData {
 	/* Clips Handles */
@@ -87,6 +182,21 @@ struct InstanceData {
 	OfxParamHandle outputTypeParam;
 	OfxParamHandle colorSourceParam;
 	OfxParamHandle postmultiplyAlphaParam;
+	OfxParamHandle shapeBucketingParam;
+	OfxParamHandle trackSubjectParam;
+	OfxParamHandle skipBordersParam;
+	OfxParamHandle interactiveProfileParam;
+	OfxParamHandle interactiveModelParam;
+	OfxParamHandle interactivePrecisionParam;
+	OfxParamHandle interactiveDownsampleRatioParam;
+	OfxParamHandle frameTimeBudgetParam;
+	OfxParamHandle cacheSizeParam;
+	OfxParamHandle maxTimeStepParam;
+	OfxParamHandle skipStaticParam;
+	OfxParamHandle staticThresholdParam;
+	OfxParamHandle shareResultsParam;
+	OfxParamHandle featureReuseParam;
+	OfxParamHandle encoderSkipsParam;
 
 	/* Cached values */
 	bool   hasGarbageMatte;
@@ -96,21 +206,59 @@ struct InstanceData {
 	enum outputTypeParamValue outputType;
 	enum colorSourceParamValue colorSource;
 	bool postmultiplyAlpha;
-
-	/* TorchScript */
-	struct _torch {
-		bool ready;
-
-		torch::Device device;
-		torch::Dtype type;
-
-		torch::jit::script::Module model;
-
-		OfxTime rn_time;
-		torch::Tensor rn[4];
-
-		_torch() : device(torch::kCPU), rn_time(nan("")) {}; /* workaround for torch::Device requiring init ... */
-	} torch;
+	enum shapeBucketingParamValue shapeBucketing;
+	bool trackSubject;
+	bool skipBorders;
+	bool interactiveProfile;
+	double interactiveDownsampleRatio;
+	double frameTimeBudget;
+	double maxTimeStep;
+	bool skipStatic;
+	double staticThreshold;
+	bool shareResults;
+	double featureReuse;
+
+	/* Last known render kind */
+	bool interactive = false;
+
+	/* Inference */
+	struct _model {
+		/* Loaded models, one per profile */
+		struct {
+			bool ready;
+			std::unique_ptr<Backend> backend;
+			uint64_t key;		/* Identity of the model */
+		} profiles[PROFILE_COUNT];
+
+		enum modelProfile profile;	/* Active profile ... */
+		Backend *backend;		/* ... and its model */
+
+		ModelCursor cur;	/* Current sequence ... */
+		ModelCursor parked[MODEL_CURSORS - 1];	/* ... and others interleaved with it */
+		uint64_t cursor_tick;
+
+		double scale;		/* Render scale */
+
+		double budget_scale;	/* Frame time budget ratio factor */
+		int budget_over;	/* Consecutive frames over / under budget */
+		int budget_under;
+
+		ModelWorker worker;	/* Inference of the current (or an aborted) frame */
+		std::vector<ModelWorker> abandoned;	/* Cancelled ones still winding down */
+
+		std::mutex lock;		/* Held while using any of the above */
+
+		std::atomic<int> encoder_skips;	/* Frames the encoder pass was reused for */
+
+		MatteCache cache;	/* Results of past frames */
+
+		_model() :
+			profiles{}, profile(PROFILE_FINAL), backend(NULL),
+			cursor_tick(0), scale(1.0),
+			budget_scale(1.0), budget_over(0), budget_under(0),
+			encoder_skips(0)
+		{};
+	} model;
 };
 
 static InstanceData *
@@ -159,61 +307,161 @@ updateParamsValidity(OfxImageEffectHandle effect)
 	enum deviceParamValue dev;
 	gParamHost->paramGetValue(priv->deviceParam, &dev);
 
+	int interactive_profile;
+	gParamHost->paramGetValue(priv->interactiveProfileParam, &interactive_profile);
+
 	switch (dev) {
 	case DEVICE_CPU:
+	case DEVICE_ONNX_CPU:
+	case DEVICE_NATIVE_CPU:
 		gParamHost->paramSetValue(priv->modelPrecisionParam, int(MODEL_PRECISION_FLOAT32));
+		gParamHost->paramSetValue(priv->interactivePrecisionParam, int(MODEL_PRECISION_FLOAT32));
 		setParamEnabledness(effect, "modelPrecision", false);
+		setParamEnabledness(effect, "interactivePrecision", false);
 		break;
 	case DEVICE_CUDA:
 		setParamEnabledness(effect, "modelPrecision", true);
+		setParamEnabledness(effect, "interactivePrecision", interactive_profile);
 		break;
 	}
 
+	/* Interactive profile */
+	setParamEnabledness(effect, "interactiveModel", interactive_profile);
+	setParamEnabledness(effect, "interactiveDownsampleRatio", interactive_profile);
+
 	/* Model -> ModelFile */
 	int model;
 	gParamHost->paramGetValue(priv->modelParam, &model);
-	setParamEnabledness(effect, "modelFile", (model == MODEL_CUSTOM));
+	setParamEnabledness(effect, "modelFile", (model == MODEL_CUSTOM) || (model == MODEL_CUSTOM_AOT));
 
 	/* OutputType -> ColorSource / PostMultiply */
 	enum outputTypeParamValue output_type;
 	gParamHost->paramGetValue(priv->outputTypeParam, &output_type);
 	setParamEnabledness(effect, "colorSource", (output_type == OUTPUT_RGBA));
 	setParamEnabledness(effect, "postmultiplyAlpha", (output_type == OUTPUT_RGBA));
+
+	/* SkipStatic -> StaticThreshold */
+	int skip_static;
+	gParamHost->paramGetValue(priv->skipStaticParam, &skip_static);
+	setParamEnabledness(effect, "staticThreshold", skip_static);
+}
+
+static void
+updateCachedParams(OfxImageEffectHandle effect)
+{
+	InstanceData *priv = getInstanceData(effect);
+
+	gParamHost->paramGetValue(priv->downsampleRatioParam, &priv->downsampleRatio);
+	gParamHost->paramGetValue(priv->outputTypeParam, &priv->outputType);
+	gParamHost->paramGetValue(priv->colorSourceParam, &priv->colorSource);
+	gParamHost->paramGetValue(priv->postmultiplyAlphaParam, &priv->postmultiplyAlpha);
+	gParamHost->paramGetValue(priv->shapeBucketingParam, &priv->shapeBucketing);
+	gParamHost->paramGetValue(priv->trackSubjectParam, &priv->trackSubject);
+	gParamHost->paramGetValue(priv->skipBordersParam, &priv->skipBorders);
+	gParamHost->paramGetValue(priv->interactiveProfileParam, &priv->interactiveProfile);
+	gParamHost->paramGetValue(priv->interactiveDownsampleRatioParam, &priv->interactiveDownsampleRatio);
+	gParamHost->paramGetValue(priv->frameTimeBudgetParam, &priv->frameTimeBudget);
+	gParamHost->paramGetValue(priv->maxTimeStepParam, &priv->maxTimeStep);
+	gParamHost->paramGetValue(priv->skipStaticParam, &priv->skipStatic);
+	gParamHost->paramGetValue(priv->staticThresholdParam, &priv->staticThreshold);
+	gParamHost->paramGetValue(priv->shareResultsParam, &priv->shareResults);
+	gParamHost->paramGetValue(priv->featureReuseParam, &priv->featureReuse);
+
+	int cache_size;
+	gParamHost->paramGetValue(priv->cacheSizeParam, &cache_size);
+	priv->model.cache.setLimit((size_t)std::max(cache_size, 0) << 20);
+}
+
+static int
+bucketSize(int v, enum shapeBucketingParamValue bucketing)
+{
+	switch (bucketing) {
+	case SHAPE_BUCKETING_64:
+		return (v + 63) & ~63;
+	case SHAPE_BUCKETING_256:
+		return (v + 255) & ~255;
+	default:
+		return v;
+	}
+}
+
+static bool
+fileExists(const char *path)
+{
+	FILE *fh = fopen(path, "rb");
+	if (!fh)
+		return false;
+	fclose(fh);
+	return true;
+}
+
+static void
+getBundledModelFilename(char *path, const char *name, int bits, const char *ext)
+{
+	/* Weights are converted to the requested precision at load, so only
+	 * one of the fp16 / fp32 files needs to be installed. Prefer the one
+	 * matching to avoid the conversion */
+	snprintf(path, PATH_MAX, "%s/Contents/Resources/rvm_%s_fp%d.%s", gBundlePath, name, bits, ext);
+
+	if (fileExists(path))
+		return;
+
+	snprintf(path, PATH_MAX, "%s/Contents/Resources/rvm_%s_fp%d.%s", gBundlePath, name, (bits == 16) ? 32 : 16, ext);
+
+	if (!fileExists(path))
+		snprintf(path, PATH_MAX, "%s/Contents/Resources/rvm_%s_fp%d.%s", gBundlePath, name, bits, ext);
+}
+
+static void
+getProfileModel(InstanceData *priv, enum modelProfile profile,
+	int *model, enum modelPrecisionParamValue *precision)
+{
+	if (profile == PROFILE_INTERACTIVE) {
+		gParamHost->paramGetValue(priv->interactiveModelParam, model);
+		gParamHost->paramGetValue(priv->interactivePrecisionParam, precision);
+	} else {
+		gParamHost->paramGetValue(priv->modelParam, model);
+		gParamHost->paramGetValue(priv->modelPrecisionParam, precision);
+	}
 }
 
 static const char *
-getModelFilename(OfxImageEffectHandle effect)
+getModelFilename(OfxImageEffectHandle effect, enum modelProfile profile)
 {
 	static char path[PATH_MAX];
 
 	InstanceData *priv = getInstanceData(effect);
 
 	/* Model */
+	enum deviceParamValue dev;
 	int model;
 	enum modelPrecisionParamValue model_precision;
 	char *model_file;
 
-	gParamHost->paramGetValue(priv->modelParam, &model);
-	gParamHost->paramGetValue(priv->modelPrecisionParam, &model_precision);
+	gParamHost->paramGetValue(priv->deviceParam, &dev);
 	gParamHost->paramGetValue(priv->modelFileParam, &model_file);
+	getProfileModel(priv, profile, &model, &model_precision);
+
+	/* Bundled model format depends on backend */
+	const char *ext = (dev == DEVICE_ONNX_CPU) ? "onnx" : "torchscript";
+	int bits = (model_precision == MODEL_PRECISION_FLOAT16) ? 16 : 32;
+
+	/* ONNX Runtime only runs float32 models, no conversion there */
+	if (dev == DEVICE_ONNX_CPU)
+		bits = 32;
 
 	/* Build path */
 	switch (model) {
 	case MODEL_MOBILENETV3:
-		snprintf(path, PATH_MAX, "%s/Contents/Resources/rvm_mobilenetv3_fp%d.torchscript",
-			gBundlePath,
-			(model_precision == MODEL_PRECISION_FLOAT16) ? 16 : 32
-		);
+		getBundledModelFilename(path, "mobilenetv3", bits, ext);
 		break;
 
 	case MODEL_RESNET50:
-		snprintf(path, PATH_MAX, "%s/Contents/Resources/rvm_resnet50_fp%d.torchscript",
-			gBundlePath,
-			(model_precision == MODEL_PRECISION_FLOAT16) ? 16 : 32
-		);
+		getBundledModelFilename(path, "resnet50", bits, ext);
 		break;
 
 	case MODEL_CUSTOM:
+	case MODEL_CUSTOM_AOT:
 		if (!model_file || !model_file[0])
 			return NULL;
 
@@ -224,83 +472,432 @@ getModelFilename(OfxImageEffectHandle effect)
 	return path;
 }
 
+static void
+cursorClear(ModelCursor &cursor)
+{
+	cursor.rn_time = nan("");
+	cursor.rn.reset();
+
+	cursor.track_time = nan("");
+
+	cursor.hold_time = nan("");
+	cursor.hold.reset();
+	cursor.hold_sig.clear();
+}
+
+/* Time matching : rounding noise allowed, and largest step between two
+ * frames of a sequence (retimed or conformed material has fractional or
+ * uneven steps) */
+#define TIME_EPSILON	1e-3
+
+static bool
+timeContinues(InstanceData *priv, OfxTime from, OfxTime to)
+{
+	double step = to - from;
+	return (step > -TIME_EPSILON) && (step < (priv->maxTimeStep + TIME_EPSILON));
+}
+
+static bool
+timeReverses(InstanceData *priv, OfxTime from, OfxTime to)
+{
+	double step = from - to;
+	return (step > TIME_EPSILON) && (step < (priv->maxTimeStep + TIME_EPSILON));
+}
+
+static bool
+cursorFollows(InstanceData *priv, const ModelCursor &cursor, OfxTime time)
+{
+	return  (cursor.profile == priv->model.profile) && (cursor.scale == priv->model.scale) &&
+		timeContinues(priv, cursor.rn_time, time);
+}
+
+static bool
+cursorReversed(InstanceData *priv, const ModelCursor &cursor, OfxTime time)
+{
+	return  (cursor.profile == priv->model.profile) && (cursor.scale == priv->model.scale) &&
+		timeReverses(priv, cursor.rn_time, time);
+}
+
+static bool
+cursorRescaled(InstanceData *priv, const ModelCursor &cursor, OfxTime time)
+{
+	return  (cursor.profile == priv->model.profile) && (cursor.scale != priv->model.scale) &&
+		timeContinues(priv, cursor.rn_time, time);
+}
+
 static void
 modelClearHistory(OfxImageEffectHandle effect)
 {
 	InstanceData *priv = getInstanceData(effect);
 
-	if (std::isnan(priv->torch.rn_time))
+	cursorClear(priv->model.cur);
+
+	for (int i=0; i<MODEL_CURSORS-1; i++)
+		cursorClear(priv->model.parked[i]);
+}
+
+/* Returns the step back if it's a sequence going backwards (it then starts
+ * over), 0.0 otherwise */
+static double
+modelSelectCursor(InstanceData *priv, OfxTime time)
+{
+	ModelCursor *c = NULL;
+	const ModelCursor *base = NULL;
+	double reverse = 0.0;
+
+	/* Continuing a sequence, the current one first */
+	for (int i=-1; (i<MODEL_CURSORS-1) && !c; i++) {
+		ModelCursor &ci = (i < 0) ? priv->model.cur : priv->model.parked[i];
+		if (cursorFollows(priv, ci, time))
+			c = &ci;
+	}
+
+	/* Same sequence going backwards, it starts over */
+	for (int i=-1; (i<MODEL_CURSORS-1) && !c; i++) {
+		ModelCursor &ci = (i < 0) ? priv->model.cur : priv->model.parked[i];
+
+		if (cursorReversed(priv, ci, time)) {
+			reverse = ci.rn_time - time;
+			cursorClear(ci);
+			c = &ci;
+		}
+	}
+
+	/* New one, replacing the least recently used. If a sequence at
+	 * another render scale gets there, it starts from a copy of it (the
+	 * state gets resampled, crops are in the other scale coordinates) */
+	if (!c) {
+		for (int i=-1; (i<MODEL_CURSORS-1) && !base; i++) {
+			const ModelCursor &ci = (i < 0) ? priv->model.cur : priv->model.parked[i];
+			if (cursorRescaled(priv, ci, time))
+				base = &ci;
+		}
+
+		c = &priv->model.parked[0];
+		for (int i=1; i<MODEL_CURSORS-1; i++)
+			if (priv->model.parked[i].last_use < c->last_use)
+				c = &priv->model.parked[i];
+
+		if (base) {
+			ModelCursor copy = *base;
+			*c = copy;
+			c->roi = OfxRectI{ 0, 0, 0, 0 };
+			c->track_roi = OfxRectI{ 0, 0, 0, 0 };
+			c->track_time = nan("");
+		} else {
+			*c = ModelCursor();
+		}
+
+		c->profile = priv->model.profile;
+		c->scale = priv->model.scale;
+	}
+
+	/* Current one is parked in its place */
+	if (c != &priv->model.cur) {
+		if (std::isnan(priv->model.cur.rn_time))
+			priv->model.cur.last_use = 0;
+
+		std::swap(priv->model.cur, *c);
+	}
+
+	priv->model.cur.last_use = ++priv->model.cursor_tick;
+
+	return reverse;
+}
+
+/* Access to the model : renders, parameter changes and the precompute (one
+ * frame at a time) take turns */
+static std::unique_lock<std::mutex>
+modelLock(InstanceData *priv)
+{
+	return std::unique_lock<std::mutex>(priv->model.lock);
+}
+
+/* Waits for all the model runs, before releasing the models */
+static void
+modelWait(InstanceData *priv)
+{
+	if (priv->model.worker.thread.joinable())
+		priv->model.worker.thread.join();
+
+	for (ModelWorker &w : priv->model.abandoned)
+		w.thread.join();
+
+	priv->model.abandoned.clear();
+}
+
+/* Cancelled runs left to wind down at most, past that they're waited for */
+#define MODEL_ABANDONED_MAX	2
+
+/* Waits for the last model run, before using the model again. A cancelled
+ * one is left behind if its backend allows it, the next frame doesn't have
+ * to wait for a result nobody wants */
+static void
+modelWaitIdle(InstanceData *priv)
+{
+	std::vector<ModelWorker> &abandoned = priv->model.abandoned;
+
+	for (auto it = abandoned.begin(); it != abandoned.end(); ) {
+		if (it->job->done) {
+			it->thread.join();
+			it = abandoned.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	ModelWorker &w = priv->model.worker;
+
+	if (!w.thread.joinable())
+		return;
+
+	if (w.job->cancel && !w.job->done && w.backend->concurrentForward() &&
+	    (abandoned.size() < MODEL_ABANDONED_MAX)) {
+		abandoned.push_back(std::move(w));
+		w = ModelWorker();
+	} else {
+		w.thread.join();
+	}
+}
+
+/* Asks the last model run to stop */
+static void
+modelCancel(InstanceData *priv)
+{
+	if (priv->model.worker.job)
+		priv->model.worker.job->cancel = true;
+}
+
+static double
+modelDownsampleRatio(InstanceData *priv, enum modelProfile profile, double scale)
+{
+	/* At a reduced render scale, the ratio is raised so the model works at
+	 * the same internal resolution as at full scale, and the matte stays
+	 * consistent with the full resolution one. The default (0.0, i.e. 1.0)
+	 * can't go higher */
+	double ratio = (profile == PROFILE_INTERACTIVE) ?
+		priv->interactiveDownsampleRatio : priv->downsampleRatio;
+
+	/* Unless the model can only run at its own */
+	const Backend *be = priv->model.profiles[profile].backend.get();
+
+	if (be && be->downsampleRatioFixed())
+		return be->downsampleRatio(0, 0, ratio);
+
+	if ((ratio == 0.0) || (scale >= 1.0) || (scale <= 0.0))
+		return ratio;
+
+	return std::min(1.0, ratio / scale);
+}
+
+/* Frame time budget control : during interactive playback, the ratio is
+ * scaled down by a factor adjusted from the measured model time. It goes
+ * down quickly when over budget and back up slowly, and is quantized so
+ * the small adjustments don't change the model input (and state) geometry */
+#define BUDGET_RATIO_MIN	0.05
+#define BUDGET_RATIO_STEP	(1.0 / 64.0)
+#define BUDGET_OVER		1.15	/* Over budget above this, for 2 frames */
+#define BUDGET_UNDER		0.75	/* Under budget below this, for 8 frames */
+
+static double
+modelBudgetRatio(InstanceData *priv, double ratio, int h, int w)
+{
+	if (!priv->interactive || (priv->frameTimeBudget <= 0.0) || (priv->model.budget_scale >= 1.0) ||
+	    priv->model.backend->downsampleRatioFixed())
+		return ratio;
+
+	/* Always an explicit ratio, relative to what would be used anyway */
+	ratio = priv->model.backend->downsampleRatio(h, w, ratio);
+
+	ratio *= priv->model.budget_scale;
+	ratio = std::round(ratio / BUDGET_RATIO_STEP) * BUDGET_RATIO_STEP;
+
+	return std::max(ratio, BUDGET_RATIO_MIN);
+}
+
+static void
+modelBudgetUpdate(InstanceData *priv, double ms)
+{
+	double budget = priv->frameTimeBudget;
+	double f = sqrt(budget / ms);	/* Cost is about quadratic in ratio */
+
+	if (!priv->interactive || (budget <= 0.0))
 		return;
 
-	priv->torch.rn_time = nan("");
+	if (ms > (BUDGET_OVER * budget)) {
+		priv->model.budget_under = 0;
+		if (++priv->model.budget_over >= 2) {
+			priv->model.budget_scale *= std::max(0.5, f);
+			priv->model.budget_over = 0;
+		}
+	} else if (ms < (BUDGET_UNDER * budget)) {
+		priv->model.budget_over = 0;
+		if (++priv->model.budget_under >= 8) {
+			priv->model.budget_scale *= std::min(1.25, f);
+			priv->model.budget_under = 0;
+		}
+	} else {
+		priv->model.budget_over = 0;
+		priv->model.budget_under = 0;
+	}
 
-	for (int i=0; i<4; i++)
-		priv->torch.rn[i] = torch::Tensor();
+	priv->model.budget_scale = std::min(std::max(priv->model.budget_scale, 0.05), 1.0);
 }
 
 static OfxStatus
-modelSetup(OfxImageEffectHandle effect)
+modelSetupProfile(OfxImageEffectHandle effect, enum modelProfile profile)
 {
 	InstanceData *priv = getInstanceData(effect);
 
-	if (priv->torch.ready)
+	if (priv->model.profiles[profile].ready)
 		return kOfxStatOK;
 
-	/* Target device and type from config */
+	/* Backend, target device and type from config */
 	enum deviceParamValue dev;
 	enum modelPrecisionParamValue precision;
+	int model;
 
 	gParamHost->paramGetValue(priv->deviceParam, &dev);
-	gParamHost->paramGetValue(priv->modelPrecisionParam, &precision);
+	getProfileModel(priv, profile, &model, &precision);
+
+	enum backendType type;
+	BackendConfig cfg;
 
 	switch (dev) {
 	case DEVICE_CPU:
-		priv->torch.device = torch::Device(torch::kCPU);
+		type = BACKEND_TORCHSCRIPT;
+		cfg.device = BACKEND_DEVICE_CPU;
 		break;
 	case DEVICE_CUDA:
-		priv->torch.device = torch::Device(torch::kCUDA);
+		type = BACKEND_TORCHSCRIPT;
+		cfg.device = BACKEND_DEVICE_CUDA;
+		break;
+	case DEVICE_ONNX_CPU:
+		type = BACKEND_ONNXRUNTIME;
+		cfg.device = BACKEND_DEVICE_CPU;
 		break;
+	case DEVICE_NATIVE_CPU:
+	default:
+		type = BACKEND_NATIVE;
+		cfg.device = BACKEND_DEVICE_CPU;
+		break;
+	}
+
+	if ((type == BACKEND_NATIVE) && (model == MODEL_RESNET50)) {
+		std::cerr << "[!] OFX Plugin error: Native CPU engine only supports mobilenetv3" << std::endl;
+		return kOfxStatFailed;
+	}
+
+	if (model == MODEL_CUSTOM_AOT) {
+		if (type != BACKEND_TORCHSCRIPT) {
+			std::cerr << "[!] OFX Plugin error: AOT compiled models require a LibTorch device" << std::endl;
+			return kOfxStatFailed;
+		}
+		type = BACKEND_TORCH_AOT;
 	}
 
 	switch (precision) {
 	case MODEL_PRECISION_FLOAT16:
-    		priv->torch.type = torch::kFloat16;
+		cfg.precision = BACKEND_PRECISION_FLOAT16;
 		break;
 	case MODEL_PRECISION_FLOAT32:
-    		priv->torch.type = torch::kFloat32;
+	default:
+		cfg.precision = BACKEND_PRECISION_FLOAT32;
 		break;
 	}
 
+	/* Release any previous model first, once nothing uses it */
+	modelWait(priv);
+
+	if (priv->model.profile == profile)
+		priv->model.backend = NULL;
+
+	priv->model.profiles[profile].backend.reset();
+
 	/* Load model */
-	const char *model_file = getModelFilename(effect);
+	cfg.model_file = getModelFilename(effect, profile);
 
-	if (!model_file)
+	if (!cfg.model_file)
 		return kOfxStatFailed;
 
 	try {
-		priv->torch.model = torch::jit::load(model_file);
-		priv->torch.model.to(priv->torch.device);
-		torch::jit::freeze(priv->torch.model);
-		torch::jit::getProfilingMode() = false;
+		priv->model.profiles[profile].backend.reset(backendCreate(type, cfg));
 	} catch (const std::exception& e) {
 		std::cerr << "[!] OFX Plugin error: Exception caught while loading model: " << e.what() << std::endl;
 		return kOfxStatFailed;
 	}
 
-	/* Reset recursive state */
+	/* Results are shared with any instance using the same model file. It's
+	 * identified by path, size and modification time, not content : a model
+	 * re-exported over the old one doesn't get old results, while copies of
+	 * one model in different places don't share */
+	uint64_t key = 0;
+
+	key = matteKeyMix(key, type);
+	key = matteKeyMix(key, cfg.device);
+	key = matteKeyMix(key, cfg.precision);
+	key = matteKeyMix(key, std::hash<std::string>()(mappedFileKey(cfg.model_file)));
+
+	priv->model.profiles[profile].key = key;
+
+	/* Reset recursive state, and past results are from the old model */
 	modelClearHistory(effect);
+	priv->model.cache.clear();
+
+	if (priv->model.profile == profile)
+		priv->model.backend = priv->model.profiles[profile].backend.get();
 
 	/* We're ready */
-	priv->torch.ready = true;
+	priv->model.profiles[profile].ready = true;
+
+	return kOfxStatOK;
+}
+
+static OfxStatus
+modelSetup(OfxImageEffectHandle effect)
+{
+	InstanceData *priv = getInstanceData(effect);
+	OfxStatus status;
+
+	/* Both profiles are kept loaded so switching between them is free */
+	status = modelSetupProfile(effect, PROFILE_FINAL);
+	if (status != kOfxStatOK)
+		return status;
+
+	if (priv->interactiveProfile)
+		return modelSetupProfile(effect, PROFILE_INTERACTIVE);
+
+	/* Not used, release it */
+	if (priv->model.profiles[PROFILE_INTERACTIVE].ready) {
+		modelWait(priv);
+		priv->model.profiles[PROFILE_INTERACTIVE].ready = false;
+		priv->model.profiles[PROFILE_INTERACTIVE].backend.reset();
+	}
 
 	return kOfxStatOK;
 }
 
+static void
+modelSelect(OfxImageEffectHandle effect, bool interactive)
+{
+	InstanceData *priv = getInstanceData(effect);
+
+	enum modelProfile profile = (interactive && priv->interactiveProfile) ?
+		PROFILE_INTERACTIVE : PROFILE_FINAL;
+
+	/* The recurrent state is specific to a model, each sequence (cursor)
+	 * is for one profile */
+	priv->model.profile = profile;
+	priv->model.backend = priv->model.profiles[profile].backend.get();
+}
+
 
 /* ------------------------------------------------------------------------- */
 /* API Handlers                                                              */
 /* ------------------------------------------------------------------------- */
 
+static void modelPrecompute(OfxImageEffectHandle effect, OfxPropertySetHandle inArgs);
+
 static OfxStatus
 effectLoad(
 	OfxImageEffectHandle effect,
@@ -317,6 +914,10 @@ effectLoad(
 	if(!gEffectHost || !gPropHost || !gParamHost)
 		return kOfxStatErrMissingHostFeature;
 
+	gProgressHost	= (OfxProgressSuiteV1 *)    gHost->fetchSuite(gHost->host, kOfxProgressSuite, 1);
+
+	gSharedCache.setLimit(SHARED_CACHE_SIZE);
+
 	return kOfxStatOK;
 }
 
@@ -331,6 +932,9 @@ effectUnload(
 	gEffectHost = NULL;
 	gPropHost   = NULL;
 	gParamHost  = NULL;
+	gProgressHost = NULL;
+
+	gSharedCache.clear();
 
 	free(gBundlePath);
 	gBundlePath = NULL;
@@ -371,12 +975,40 @@ effectCreateInstance(
 	gParamHost->paramGetHandle(paramSet, "outputType",         &priv->outputTypeParam, 0);
 	gParamHost->paramGetHandle(paramSet, "colorSource",        &priv->colorSourceParam, 0);
 	gParamHost->paramGetHandle(paramSet, "postmultiplyAlpha",  &priv->postmultiplyAlphaParam, 0);
+	gParamHost->paramGetHandle(paramSet, "shapeBucketing",     &priv->shapeBucketingParam, 0);
+	gParamHost->paramGetHandle(paramSet, "trackSubject",       &priv->trackSubjectParam, 0);
+	gParamHost->paramGetHandle(paramSet, "skipBorders",        &priv->skipBordersParam, 0);
+	gParamHost->paramGetHandle(paramSet, "interactiveProfile", &priv->interactiveProfileParam, 0);
+	gParamHost->paramGetHandle(paramSet, "interactiveModel",   &priv->interactiveModelParam, 0);
+	gParamHost->paramGetHandle(paramSet, "interactivePrecision", &priv->interactivePrecisionParam, 0);
+	gParamHost->paramGetHandle(paramSet, "interactiveDownsampleRatio", &priv->interactiveDownsampleRatioParam, 0);
+	gParamHost->paramGetHandle(paramSet, "frameTimeBudget",    &priv->frameTimeBudgetParam, 0);
+	gParamHost->paramGetHandle(paramSet, "cacheSize",          &priv->cacheSizeParam, 0);
+	gParamHost->paramGetHandle(paramSet, "maxTimeStep",        &priv->maxTimeStepParam, 0);
+	gParamHost->paramGetHandle(paramSet, "skipStatic",         &priv->skipStaticParam, 0);
+	gParamHost->paramGetHandle(paramSet, "staticThreshold",    &priv->staticThresholdParam, 0);
+	gParamHost->paramGetHandle(paramSet, "shareResults",       &priv->shareResultsParam, 0);
+	gParamHost->paramGetHandle(paramSet, "featureReuse",       &priv->featureReuseParam, 0);
+	gParamHost->paramGetHandle(paramSet, "encoderSkips",       &priv->encoderSkipsParam, 0);
+
+	/* Initial mattes connection state */
+	OfxPropertySetHandle clipProps;
+	int connected;
+
+	gEffectHost->clipGetPropertySet(priv->garbageMatteClip, &clipProps);
+	gPropHost->propGetInt(clipProps, kOfxImageClipPropConnected, 0, &connected);
+	priv->hasGarbageMatte = connected;
+
+	gEffectHost->clipGetPropertySet(priv->solidMatteClip, &clipProps);
+	gPropHost->propGetInt(clipProps, kOfxImageClipPropConnected, 0, &connected);
+	priv->hasSolidMatte = connected;
 
 	/* Set private instance data */
 	gPropHost->propSetPointer(effectProps, kOfxPropInstanceData, 0, (void *) priv);
 
 	/* Update wiht loaded params values */
 	updateParamsValidity(effect);
+	updateCachedParams(effect);
 
 	return kOfxStatOK;
 }
@@ -390,8 +1022,11 @@ effectDestroyInstance(
 {
 	InstanceData *priv = getInstanceData(effect);
 
-	if (priv)
+	if (priv) {
+		modelCancel(priv);
+		modelWait(priv);
 		delete priv;
+	}
 
 	return kOfxStatOK;
 }
@@ -413,6 +1048,9 @@ effectInstanceChanged(
 	if (strcmp(changeReason, kOfxChangeUserEdited) != 0)
 		return kOfxStatReplyDefault;
 
+	/* Counters can only be shown from there, not while rendering */
+	gParamHost->paramSetValue(priv->encoderSkipsParam, (int)priv->model.encoder_skips);
+
 	/* Fetch the type & name of the object that changed */
 	char *typeChanged;
 	gPropHost->propGetString(inArgs, kOfxPropType, 0, &typeChanged);
@@ -423,19 +1061,56 @@ effectInstanceChanged(
 	char *objChanged;
 	gPropHost->propGetString(inArgs, kOfxPropName, 0, &objChanged);
 
-	/* Some changes invalidate things */
 	if (isParam && (
-	    !strcmp(objChanged, "device") ||
+	    !strcmp(objChanged, "precompute"))) {
+		modelPrecompute(effect, inArgs);
+		gParamHost->paramSetValue(priv->encoderSkipsParam, (int)priv->model.encoder_skips);
+		return kOfxStatOK;
+	}
+
+	/* Some changes invalidate things, not while a frame is using them */
+	std::unique_lock<std::mutex> lock = modelLock(priv);
+
+	if (isParam && (
+	    !strcmp(objChanged, "device"))) {
+		priv->model.profiles[PROFILE_FINAL].ready = false;	/* Reload models */
+		priv->model.profiles[PROFILE_INTERACTIVE].ready = false;
+		return kOfxStatOK;
+	}
+
+	if (isParam && (
 	    !strcmp(objChanged, "model") ||
 	    !strcmp(objChanged, "modelPrecision") ||
 	    !strcmp(objChanged, "modelFile"))) {
-	    	priv->torch.ready = false;	/* Reload model */
+	    	priv->model.profiles[PROFILE_FINAL].ready = false;	/* Reload model */
+		return kOfxStatOK;
+	}
+
+	if (isParam && (
+	    !strcmp(objChanged, "interactiveModel") ||
+	    !strcmp(objChanged, "interactivePrecision"))) {
+	    	priv->model.profiles[PROFILE_INTERACTIVE].ready = false;	/* Reload model */
+		return kOfxStatOK;
+	}
+
+	if (isParam && (
+	    !strcmp(objChanged, "frameTimeBudget"))) {
+		priv->model.budget_scale = 1.0;		/* Restart control */
+		return kOfxStatOK;
+	}
+
+	if (isParam && (
+	    !strcmp(objChanged, "downsampleRatio") ||
+	    !strcmp(objChanged, "interactiveDownsampleRatio"))) {
+		priv->model.cache.clear();	/* State gets resampled, results differ */
 		return kOfxStatOK;
 	}
 
 	if (isParam && (
-	    !strcmp(objChanged, "downsampleRatio"))) {
-		modelClearHistory(effect);	/* Recursive history invalidate */
+	    !strcmp(objChanged, "shapeBucketing") ||
+	    !strcmp(objChanged, "trackSubject") ||
+	    !strcmp(objChanged, "featureReuse"))) {
+		priv->model.cache.clear();	/* Results would differ */
 		return kOfxStatOK;
 	}
 
@@ -448,19 +1123,20 @@ effectInstanceChanged(
 		gEffectHost->clipGetHandle(effect, objChanged, &clip, &props);
 		gPropHost->propGetInt(props,  kOfxImageClipPropConnected, 0, &connected);
 
-		/* Input -> Invalidate recursive history */
-		if (strcmp(objChanged, "Input")) {
+		/* Input -> Invalidate recursive history and results */
+		if (!strcmp(objChanged, "Input")) {
 			modelClearHistory(effect);
+			priv->model.cache.clear();
 			return kOfxStatOK;
 		}
 
 		/* GarbageMatte / SolidMatte -> Check if connected */
-		if (strcmp(objChanged, "GarbageMatte")) {
+		if (!strcmp(objChanged, "GarbageMatte")) {
 			priv->hasGarbageMatte = connected;
 			return kOfxStatOK;
 		}
 
-		if (isClip && !strcmp(objChanged, "SolidMatte")) {
+		if (!strcmp(objChanged, "SolidMatte")) {
 			priv->hasSolidMatte = connected;
 			return kOfxStatOK;
 		}
@@ -477,8 +1153,6 @@ effectEndInstanceChanged(
 	OfxPropertySetHandle inArgs,
 	OfxPropertySetHandle outArgs)
 {
-	InstanceData *priv = getInstanceData(effect);
-
 	/* If it's a user edit : Update enabled params */
 	char *changeReason;
 	gPropHost->propGetString(inArgs, kOfxPropChangeReason, 0, &changeReason);
@@ -486,10 +1160,7 @@ effectEndInstanceChanged(
 		updateParamsValidity(effect);
 
 	/* Update cached param values int all cases */
-	gParamHost->paramGetValue(priv->downsampleRatioParam, &priv->downsampleRatio);
-	gParamHost->paramGetValue(priv->outputTypeParam, &priv->outputType);
-	gParamHost->paramGetValue(priv->colorSourceParam, &priv->colorSource);
-	gParamHost->paramGetValue(priv->postmultiplyAlphaParam, &priv->postmultiplyAlpha);
+	updateCachedParams(effect);
 
 	/* Done */
 	return kOfxStatOK;
@@ -519,9 +1190,15 @@ effectDescribe(
 	/* Don't allow tiling, we need the full images at once */
 	gPropHost->propSetInt(effectProps, kOfxImageEffectPropSupportsTiles, 0, 0);
 
+	/* Proxy / reduced render scales are handled */
+	gPropHost->propSetInt(effectProps, kOfxImageEffectPropSupportsMultiResolution, 0, 1);
+
 	/* We need to render things in sequence */
 	gPropHost->propSetInt(effectProps, kOfxImageEffectInstancePropSequentialRender, 0, 1);
 
+	/* Frames before the current one are used for reverse playback */
+	gPropHost->propSetInt(effectProps, kOfxImageEffectPropTemporalClipAccess, 0, 1);
+
 	/* Parameters that affect clip preferences */
 	gPropHost->propSetString(effectProps, kOfxImageEffectPropClipPreferencesSlaveParam, 0, "outputType");
 	gPropHost->propSetString(effectProps, kOfxImageEffectPropClipPreferencesSlaveParam, 0, "postmultiplyAlpha");
@@ -589,8 +1266,10 @@ effectDescribeInContext(
 	gPropHost->propSetString(props, kOfxPropLabel, 0, "Compute Device");
 	gPropHost->propSetString(props, kOfxParamPropHint, 0, "What device backend to use to run model");
 	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
-	gPropHost->propSetString(props, kOfxParamPropChoiceOption, DEVICE_CPU,  "CPU");
-	gPropHost->propSetString(props, kOfxParamPropChoiceOption, DEVICE_CUDA, "CUDA");
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, DEVICE_CPU,      "CPU");
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, DEVICE_CUDA,     "CUDA");
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, DEVICE_ONNX_CPU, "CPU (ONNX Runtime)");
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, DEVICE_NATIVE_CPU, "CPU (Native)");
 
 		/* Model */
 	gParamHost->paramDefine(paramSet, kOfxParamTypeChoice, "model", &props);
@@ -600,6 +1279,7 @@ effectDescribeInContext(
 	gPropHost->propSetString(props, kOfxParamPropChoiceOption, MODEL_MOBILENETV3, "mobilenetv3");
 	gPropHost->propSetString(props, kOfxParamPropChoiceOption, MODEL_RESNET50,    "resnet50");
 	gPropHost->propSetString(props, kOfxParamPropChoiceOption, MODEL_CUSTOM,      "custom");
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, MODEL_CUSTOM_AOT,  "custom (AOT compiled)");
 
 		/* Model File (custom) */
 	gParamHost->paramDefine(paramSet, kOfxParamTypeString, "modelFile", &props);
@@ -612,7 +1292,7 @@ effectDescribeInContext(
 		/* Model Precision */
 	gParamHost->paramDefine(paramSet, kOfxParamTypeChoice, "modelPrecision", &props);
 	gPropHost->propSetString(props, kOfxPropLabel, 0, "Model Precision");
-	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Precision to use (for custom models, must match file !)");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Precision to use (model weights are converted at load if needed)");
 	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
 	gPropHost->propSetString(props, kOfxParamPropChoiceOption, MODEL_PRECISION_FLOAT16, "float16");
 	gPropHost->propSetString(props, kOfxParamPropChoiceOption, MODEL_PRECISION_FLOAT32, "float32");
@@ -622,7 +1302,7 @@ effectDescribeInContext(
 		/* Downsample ratio */
 	gParamHost->paramDefine(paramSet, kOfxParamTypeDouble, "downsampleRatio", &props);
 	gPropHost->propSetString(props, kOfxPropLabel, 0, "Downsample ratio");
-	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Image downsampling ratio. Set to 0.0 for model auto-select");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Image downsampling ratio. Set to 0.0 for the model default of 1.0, the same with every backend (AOT compiled models use the ratio they were exported with)");
 	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
 	gPropHost->propSetString(props, kOfxParamPropDoubleType, 0, kOfxParamDoubleTypeScale);
 	gPropHost->propSetDouble(props, kOfxParamPropMin, 0, 0.0);
@@ -652,28 +1332,166 @@ effectDescribeInContext(
 	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Enable/Disable multiplying RGB with Alpha on the output");
 	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
 
-	return kOfxStatOK;
-}
+		/* Shape bucketing */
+	gParamHost->paramDefine(paramSet, kOfxParamTypeChoice, "shapeBucketing", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Shape Bucketing");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Pad input (replicating its edges) up to a multiple of the given size so that different resolutions share the same warmed-up model executor. The matte near the padded edges can differ slightly from an unpadded run");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, SHAPE_BUCKETING_OFF, "Off");
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, SHAPE_BUCKETING_64,  "64 px");
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, SHAPE_BUCKETING_256, "256 px");
+
+		/* Subject tracking */
+	gParamHost->paramDefine(paramSet, kOfxParamTypeBoolean, "trackSubject", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Track Subject");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Run the model on a crop around the subject found in the previous frame, falling back to the full frame when it's lost or leaves the crop");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
 
+		/* Letterbox borders */
+	gParamHost->paramDefine(paramSet, kOfxParamTypeBoolean, "skipBorders", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Skip Letterbox Borders");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Detect constant color borders (letterbox / pillarbox) and only run the model on the active picture area, borders are output as transparent black (zero color and alpha)");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetInt   (props, kOfxParamPropDefault, 0, 0);
 
-static OfxStatus
-effectGetClipPreferences(
-	OfxImageEffectHandle effect,
-	OfxPropertySetHandle inArgs,
-	OfxPropertySetHandle outArgs)
-{
-	InstanceData *priv = getInstanceData(effect);
-	OfxStatus status = kOfxStatOK;
+		/* Interactive profile */
+	gParamHost->paramDefine(paramSet, kOfxParamTypeBoolean, "interactiveProfile", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Interactive Profile");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Use a separate (faster) model configuration for interactive viewer playback, the settings above being used for final renders");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
 
-	/* Input clip */
-		/* FIXME should we check that kOfxImageClipPropUnmappedComponents is RGB / RGBA ? */
-	gPropHost->propSetString(outArgs, "OfxImageClipPropDepth_Input", 0, kOfxBitDepthFloat);
+	gParamHost->paramDefine(paramSet, kOfxParamTypeChoice, "interactiveModel", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Interactive Model");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "What model to load for interactive playback");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, MODEL_MOBILENETV3, "mobilenetv3");
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, MODEL_RESNET50,    "resnet50");
+	gPropHost->propSetInt   (props, kOfxParamPropEnabled, 0, 0);
 
-	/* GarbageMatte / SolidMatte clips */
-	if (priv->hasGarbageMatte) {
-		gPropHost->propSetString(outArgs, "OfxImageClipPropComponents_GarbageMatte", 0, kOfxImageComponentAlpha);
-		gPropHost->propSetString(outArgs, "OfxImageClipPropDepth_GarbageMatte", 0, kOfxBitDepthFloat);
-	}
+	gParamHost->paramDefine(paramSet, kOfxParamTypeChoice, "interactivePrecision", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Interactive Precision");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Precision to use for interactive playback");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, MODEL_PRECISION_FLOAT16, "float16");
+	gPropHost->propSetString(props, kOfxParamPropChoiceOption, MODEL_PRECISION_FLOAT32, "float32");
+	gPropHost->propSetInt   (props, kOfxParamPropDefault, 0, MODEL_PRECISION_FLOAT16);
+	gPropHost->propSetInt   (props, kOfxParamPropEnabled, 0, 0);
+
+	gParamHost->paramDefine(paramSet, kOfxParamTypeDouble, "interactiveDownsampleRatio", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Interactive Downsample ratio");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Image downsampling ratio for interactive playback. Set to 0.0 for the model default of 1.0");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetString(props, kOfxParamPropDoubleType, 0, kOfxParamDoubleTypeScale);
+	gPropHost->propSetDouble(props, kOfxParamPropMin, 0, 0.0);
+	gPropHost->propSetDouble(props, kOfxParamPropMax, 0, 1.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDefault, 0, 0.125);
+	gPropHost->propSetInt   (props, kOfxParamPropEnabled, 0, 0);
+
+		/* Frame time budget */
+	gParamHost->paramDefine(paramSet, kOfxParamTypeDouble, "frameTimeBudget", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Interactive Time Budget (ms)");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Target model time per frame during interactive playback, the downsample ratio being lowered as needed to hold it. Set to 0.0 to disable");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetDouble(props, kOfxParamPropMin, 0, 0.0);
+	gPropHost->propSetDouble(props, kOfxParamPropMax, 0, 10000.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDisplayMin, 0, 0.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDisplayMax, 0, 200.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDefault, 0, 0.0);
+
+		/* Time step */
+	gParamHost->paramDefine(paramSet, kOfxParamTypeDouble, "maxTimeStep", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Max Time Step");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Largest step between two frames (in frames) still rendered as a continuous sequence, keeping the temporal context. Raise it for retimed / sped up clips");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetDouble(props, kOfxParamPropMin, 0, 0.0);
+	gPropHost->propSetDouble(props, kOfxParamPropMax, 0, 100.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDisplayMin, 0, 0.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDisplayMax, 0, 4.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDefault, 0, 1.0);
+
+		/* Static frames */
+	gParamHost->paramDefine(paramSet, kOfxParamTypeBoolean, "skipStatic", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Skip Static Frames");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Reuse the previous matte instead of running the model when a frame is the same as the previous one (freeze frames, holds, pulldown duplicates)");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetInt   (props, kOfxParamPropDefault, 0, 0);
+
+	gParamHost->paramDefine(paramSet, kOfxParamTypeDouble, "staticThreshold", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Static Frame Threshold");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Largest change (of the mean level over any part of the frame) still considered static, for noisy or recompressed holds. Set to 0.0 to only skip identical frames");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetDouble(props, kOfxParamPropMin, 0, 0.0);
+	gPropHost->propSetDouble(props, kOfxParamPropMax, 0, 1.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDisplayMin, 0, 0.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDisplayMax, 0, 0.05);
+	gPropHost->propSetDouble(props, kOfxParamPropDefault, 0, 0.0);
+
+		/* Encoder reuse */
+	gParamHost->paramDefine(paramSet, kOfxParamTypeDouble, "featureReuse", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Encoder Reuse Threshold");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Largest change of the (downsampled) input, as a mean over all pixels, for which the encoder pass of a previous frame is reused, only the decoder and refiner running. Faster on locked-off shots, at the cost of some accuracy where things move. Native CPU device and TorchScript models only. Set to 0.0 to disable");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetDouble(props, kOfxParamPropMin, 0, 0.0);
+	gPropHost->propSetDouble(props, kOfxParamPropMax, 0, 1.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDisplayMin, 0, 0.0);
+	gPropHost->propSetDouble(props, kOfxParamPropDisplayMax, 0, 0.02);
+	gPropHost->propSetDouble(props, kOfxParamPropDefault, 0, 0.0);
+
+	gParamHost->paramDefine(paramSet, kOfxParamTypeInteger, "encoderSkips", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Skipped Encoder Passes");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Frames rendered so far by this node with the encoder pass reused (refreshed on any parameter edit)");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetInt   (props, kOfxParamPropPersistant, 0, 0);
+	gPropHost->propSetInt   (props, kOfxParamPropEvaluateOnChange, 0, 0);
+	gPropHost->propSetInt   (props, kOfxParamPropEnabled, 0, 0);
+
+	gParamHost->paramDefine(paramSet, kOfxParamTypePushButton, "refreshStats", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Refresh");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Update the skipped encoder passes count");
+
+		/* Matte cache */
+	gParamHost->paramDefine(paramSet, kOfxParamTypeInteger, "cacheSize", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Matte Cache Size (MB)");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Memory used to keep the model results of past frames (and the recurrent state after them), so frames rendered again don't run the model. Set to 0 to disable");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetInt   (props, kOfxParamPropMin, 0, 0);
+	gPropHost->propSetInt   (props, kOfxParamPropMax, 0, 65536);
+	gPropHost->propSetInt   (props, kOfxParamPropDisplayMin, 0, 0);
+	gPropHost->propSetInt   (props, kOfxParamPropDisplayMax, 0, 8192);
+	gPropHost->propSetInt   (props, kOfxParamPropDefault, 0, 512);
+
+	gParamHost->paramDefine(paramSet, kOfxParamTypePushButton, "precompute", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Precompute Clip");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Render the whole input clip to the matte cache, in sequence as a final render would. This is a blocking action : the host waits for it to complete, or to be cancelled from its progress bar if it has one");
+
+	gParamHost->paramDefine(paramSet, kOfxParamTypeBoolean, "shareResults", &props);
+	gPropHost->propSetString(props, kOfxPropLabel, 0, "Share Results Between Nodes");
+	gPropHost->propSetString(props, kOfxParamPropHint, 0, "Nodes running the same model on the same input frames (from the same starting point) use each other's results instead of all running the model");
+	gPropHost->propSetInt   (props, kOfxParamPropAnimates, 0, 0);
+	gPropHost->propSetInt   (props, kOfxParamPropDefault, 0, 0);
+
+	return kOfxStatOK;
+}
+
+
+static OfxStatus
+effectGetClipPreferences(
+	OfxImageEffectHandle effect,
+	OfxPropertySetHandle inArgs,
+	OfxPropertySetHandle outArgs)
+{
+	InstanceData *priv = getInstanceData(effect);
+	OfxStatus status = kOfxStatOK;
+
+	/* Input clip */
+		/* FIXME should we check that kOfxImageClipPropUnmappedComponents is RGB / RGBA ? */
+	gPropHost->propSetString(outArgs, "OfxImageClipPropDepth_Input", 0, kOfxBitDepthFloat);
+
+	/* GarbageMatte / SolidMatte clips */
+	if (priv->hasGarbageMatte) {
+		gPropHost->propSetString(outArgs, "OfxImageClipPropComponents_GarbageMatte", 0, kOfxImageComponentAlpha);
+		gPropHost->propSetString(outArgs, "OfxImageClipPropDepth_GarbageMatte", 0, kOfxBitDepthFloat);
+	}
 
 	if (priv->hasSolidMatte) {
 		gPropHost->propSetString(outArgs, "OfxImageClipPropComponents_SolidMatte", 0, kOfxImageComponentAlpha);
@@ -710,21 +1528,55 @@ effectBeginSequenceRender(
 	InstanceData *priv = getInstanceData(effect);
 	OfxStatus status = kOfxStatOK;
 
-	(void)priv;
+	/* Get sequence range and scale */
+	OfxRangeD range;
+	OfxPointD scale;
 
-#if 0
-	int is_interactive, sequential_status, interactive_status;
+	gPropHost->propGetDoubleN(inArgs, kOfxImageEffectPropFrameRange, 2, &range.min);
+	gPropHost->propGetDoubleN(inArgs, kOfxImageEffectPropRenderScale, 2, &scale.x);
 
-	gPropHost->propGetInt(inArgs, kOfxPropIsInteractive, 0, &is_interactive);
-	gPropHost->propGetInt(inArgs, kOfxImageEffectPropSequentialRenderStatus,  0, &sequential_status);
-	gPropHost->propGetInt(inArgs, kOfxImageEffectPropInteractiveRenderStatus, 0, &interactive_status);
+	/* Interactive playback or final render */
+	int is_interactive;
 
-	printf("Begin: is_interactive=%d, sequential_status=%d, interactive_status=%d\n",
-		is_interactive,
-		sequential_status,
-		interactive_status
-	);
-#endif
+	auto lock = modelLock(priv);
+
+	if (gPropHost->propGetInt(inArgs, kOfxPropIsInteractive, 0, &is_interactive) == kOfxStatOK)
+		priv->interactive = is_interactive;
+
+	/* Input resolution for the sequence */
+	OfxRectD rod;
+	OfxPropertySetHandle clipProps;
+	double par = 1.0;
+
+	if (gEffectHost->clipGetRegionOfDefinition(priv->inputClip, range.min, &rod) != kOfxStatOK)
+		return status;
+
+	gEffectHost->clipGetPropertySet(priv->inputClip, &clipProps);
+	gPropHost->propGetDouble(clipProps, kOfxImagePropPixelAspectRatio, 0, &par);
+
+	int w = (int)ceil(rod.x2 * scale.x / par) - (int)floor(rod.x1 * scale.x / par);
+	int h = (int)ceil(rod.y2 * scale.y)       - (int)floor(rod.y1 * scale.y);
+
+	if ((w <= 0) || (h <= 0))
+		return status;
+
+	/* Warm up an executor for it so first frame runs at full speed */
+	modelWaitIdle(priv);
+
+	if (modelSetup(effect) != kOfxStatOK)
+		return status;
+
+	modelSelect(effect, priv->interactive);
+
+	try {
+		priv->model.backend->warmup(
+			bucketSize(h, priv->shapeBucketing),
+			bucketSize(w, priv->shapeBucketing),
+			modelDownsampleRatio(priv, priv->model.profile, std::max(scale.x, scale.y))
+		);
+	} catch (const std::exception& e) {
+		std::cerr << "[!] OFX Plugin error: Exception caught while warming up model: " << e.what() << std::endl;
+	}
 
 	return status;
 }
@@ -745,15 +1597,7 @@ effectEndSequenceRender(
 
 
 class NoImageEx {};
-
-struct ImageInfo {
-	OfxPropertySetHandle h;
-	OfxRectI rect;
-	int rowBytes;
-	void *ptr;
-	char *pixelDepth;
-	char *components;
-};
+class AbortEx {};
 
 static OfxStatus
 fillImageInfos(
@@ -777,116 +1621,763 @@ fillImageInfos(
 	return kOfxStatOK;
 }
 
-static torch::Tensor
-imageToTensor(struct ImageInfo &img, torch::Device td, torch::Dtype tt)
+static BackendStatePtr
+modelRemapState(Backend &be, const ModelCursor &cur,
+	const OfxRectI &to, const OfxRectI &to_input, double to_ratio)
 {
-	int w = img.rect.x2 - img.rect.x1;
-	int h = img.rect.y2 - img.rect.y1;
-	int nc, vs;
-	uint8_t *p;
-	torch::Dtype dt;
-	float sf = 1.0f;
-
-	if (!strcmp(img.components, kOfxImageComponentRGBA)) {
-		nc = 4;
-	} else if (!strcmp(img.components, kOfxImageComponentRGB )) {
-		nc = 3;
-	} else if (!strcmp(img.components, kOfxImageComponentAlpha)) {
-		nc = 1;
-	} else {
-		return torch::Tensor();
+	PlanarImage rn[4];
+
+	if (!be.stateExport(rn, *cur.rn) ||
+	    !roiRemapState(rn, cur.rn_rect, cur.rn_input, cur.rn_downsample_ratio, to, to_input, to_ratio))
+		return BackendStatePtr();
+
+	return be.stateImport(rn);
+}
+
+/* Interval to poll the host for abort while the model runs */
+#define ABORT_POLL_MS	10
+
+static void
+modelRun(OfxImageEffectHandle effect, const ModelJobPtr &job,
+	const std::function<void()> &meanwhile)
+{
+	InstanceData *priv = getInstanceData(effect);
+	Backend *be = priv->model.backend;
+
+	auto done = std::make_shared<std::promise<void>>();
+	std::future<void> result = done->get_future();
+
+	/* Run on a worker thread, the render thread stays responsive */
+	modelWaitIdle(priv);
+
+	job->fwd.cancel = &job->cancel;
+
+	priv->model.worker.job = job;
+	priv->model.worker.backend = be;
+	priv->model.worker.thread = std::thread([be, job, done]() {
+		try {
+			be->forward(job->fwd);
+			done->set_value();
+		} catch (...) {
+			done->set_exception(std::current_exception());
+		}
+		job->done = true;
+	});
+
+	/* Whatever the render thread has to do meanwhile */
+	meanwhile();
+
+	/* On abort, ask the backend to stop at the next stage and leave the
+	 * job to complete in the background. Nothing of it is kept */
+	while (result.wait_for(std::chrono::milliseconds(ABORT_POLL_MS)) != std::future_status::ready) {
+		if (gEffectHost->abort(effect)) {
+			job->cancel = true;
+			throw AbortEx();
+		}
+	}
+
+	result.get();	/* Rethrows backend errors */
+
+	if (job->fwd.cancelled)
+		throw AbortEx();
+}
+
+/* Subject tracking : full pass interval, and largest crop worth using
+ * (fraction of the frame area) */
+#define TRACK_REFRESH_FRAMES	25
+#define TRACK_MAX_AREA		0.5
+
+static OfxRectI
+modelTrackSelect(InstanceData *priv, OfxTime time, const OfxRectI &frame)
+{
+	/* Needs a subject from the previous frame, and regularly a full pass
+	 * to catch anything new entering the frame */
+	if (!priv->trackSubject ||
+	    !timeContinues(priv, priv->model.cur.track_time, time) ||
+	    (++priv->model.cur.track_frames >= TRACK_REFRESH_FRAMES))
+		return frame;
+
+	roiSelect(priv->model.cur.track_roi, priv->model.cur.track_bbox, frame);
+
+	OfxRectI roi = roiIntersect(priv->model.cur.track_roi, frame);
+
+	double area_roi   = (double)(roi.x2 - roi.x1) * (roi.y2 - roi.y1);
+	double area_frame = (double)(frame.x2 - frame.x1) * (frame.y2 - frame.y1);
+
+	if (roiEmpty(roi) || (area_roi > TRACK_MAX_AREA * area_frame))
+		return frame;
+
+	return roi;
+}
+
+/* Output -> OFX Image (with post processing depending on options). The
+ * input color is converted again if not given */
+static void
+modelOutput(InstanceData *priv, const ImageInfo &outputImg, const ImageInfo &inputImg,
+	const ImageInfo *garbageImg, const ImageInfo *solidImg, const OfxRectI &roi,
+	const PlanarImage *src, const PlanarImage &fgr, const PlanarImage &pha)
+{
+	bool rgba = priv->outputType == OUTPUT_RGBA;
+	const PlanarImage *color = &fgr;
+	PlanarImage src_roi;
+
+	if (rgba && (priv->colorSource == COLOR_SRC_INPUT)) {
+		if (!src) {
+			if (!imageToPlanar(src_roi, inputImg, roi, 0, 0))
+				throw NoImageEx();
+			src = &src_roi;
+		}
+		color = src;
+	}
+
+	if (!planarToImage(outputImg, roi, *color, pha, garbageImg, solidImg,
+	                   rgba, priv->postmultiplyAlpha))
+		throw NoImageEx();
+}
+
+/* Input content hash over a crop, to match known results. Only computed
+ * once something needs it */
+class InputHash {
+public:
+	InputHash(const ImageInfo &img, const OfxRectI &roi) :
+		img(img), roi(roi), done(false), value(0) {};
+
+	uint64_t get() {
+		if (!this->done) {
+			this->value = imageHash(this->img, this->roi);
+			this->done = true;
+		}
+		return this->value;
+	}
+
+private:
+	const ImageInfo &img;
+	OfxRectI roi;
+	bool done;
+	uint64_t value;
+};
+
+/* Key of the result of a frame : the model, its input (content, crop and
+ * geometry) and the recurrent state it goes on from, which is itself the
+ * key of the result it came from. Also gives the ratio the model runs at */
+static uint64_t
+modelResultKey(InstanceData *priv, OfxTime time, const OfxRectI &input,
+	const OfxRectI &frame, const OfxRectI &roi, uint64_t hash,
+	double base_ratio, double &ratio)
+{
+	int in_h = bucketSize(roi.y2 - roi.y1, priv->shapeBucketing);
+	int in_w = bucketSize(roi.x2 - roi.x1, priv->shapeBucketing);
+
+	ratio = modelBudgetRatio(priv, base_ratio, in_h, in_w);
+
+	bool use_rn = priv->model.cur.rn &&
+		timeContinues(priv, priv->model.cur.rn_time, time);
+
+	const int32_t geom[] = {
+		input.x1, input.y1, input.x2, input.y2,
+		frame.x1, frame.y1, frame.x2, frame.y2,
+		roi.x1,   roi.y1,   roi.x2,   roi.y2,
+		in_h, in_w,
+	};
+
+	uint64_t ratio_bits;
+	memcpy(&ratio_bits, &ratio, sizeof(double));
+
+	uint64_t key = priv->model.profiles[priv->model.profile].key;
+
+	key = matteKeyMix(key, use_rn ? priv->model.cur.rn_key : 0);
+	key = matteKeyMix(key, hash);
+	key = matteKeyMix(key, ratio_bits);
+
+	for (int32_t v : geom)
+		key = matteKeyMix(key, (uint32_t)v);
+
+	return key;
+}
+
+static MatteCacheEntryPtr
+modelShared(OfxImageEffectHandle effect, OfxTime time,
+	const ImageInfo *outputImg, const ImageInfo &inputImg,
+	const ImageInfo *garbageImg, const ImageInfo *solidImg,
+	const OfxRectI &frame, InputHash &hash, uint64_t key,
+	double base_ratio, double ratio)
+{
+	InstanceData *priv = getInstanceData(effect);
+
+	MatteCacheEntryPtr e = gSharedCache.find(key);
+	bool want_fgr = (priv->outputType == OUTPUT_RGBA) && (priv->colorSource != COLOR_SRC_INPUT);
+
+	if (!e || (e->hash != hash.get()) || (want_fgr && e->fgr.empty()))
+		return MatteCacheEntryPtr();
+
+	/* Exactly what this instance would have computed, sequence goes on
+	 * from there */
+	priv->model.cur.rn_time = time;
+	priv->model.cur.rn_rect = e->rect;
+	priv->model.cur.rn_input = e->input_rect;
+	priv->model.cur.rn_downsample_ratio = ratio;
+	priv->model.cur.rn = e->state;
+	priv->model.cur.rn_key = key;
+
+	if (priv->trackSubject) {
+		bool found = roiAlphaBounds(priv->model.cur.track_bbox, e->pha, e->roi);
+		priv->model.cur.track_time = found ? time : nan("");
+		priv->model.cur.track_roi = e->roi;
+		if (roiEqual(e->roi, frame))
+			priv->model.cur.track_frames = 0;
 	}
 
-	if (!strcmp(img.pixelDepth, kOfxBitDepthByte)) {
-		vs = 1;
-		dt = torch::kByte;
-		sf = 1.0f / 255.0f;
-	} else if (!strcmp(img.pixelDepth, kOfxBitDepthShort)) {
-		vs = 2;
-		dt = torch::kShort;
-		sf = 1.0f / 32768.0f;
-	} else if (!strcmp(img.pixelDepth, kOfxBitDepthHalf)) {
-		vs = 2;
-		dt = torch::kFloat16;
-	} else if (!strcmp(img.pixelDepth, kOfxBitDepthFloat)) {
-		vs = 4;
-		dt = torch::kFloat32;
+	if (outputImg)
+		modelOutput(priv, *outputImg, inputImg, garbageImg, solidImg, e->roi,
+			NULL, e->fgr, e->pha);
+
+	/* Can go in our own cache too if it's labeled as we'd have done */
+	if (priv->model.cache.getLimit() && (ratio == base_ratio) &&
+	    (e->profile == priv->model.profile) && (e->scale == priv->model.scale) &&
+	    (e->downsample_ratio == base_ratio))
+		priv->model.cache.insert(time, e);
+
+	return e;
+}
+
+static MatteCacheEntryPtr
+modelRender(OfxImageEffectHandle effect, OfxTime time,
+	const ImageInfo *outputImg, const ImageInfo &inputImg,
+	const ImageInfo *garbageImg, const ImageInfo *solidImg,
+	const OfxRectI &frame, InputHash &hash)
+{
+	InstanceData *priv = getInstanceData(effect);
+
+	/* Crop to run the model on */
+	OfxRectI roi = modelTrackSelect(priv, time, frame);
+	double base_ratio = modelDownsampleRatio(priv, priv->model.profile, priv->model.scale);
+
+	/* Another instance may have done it already. Not sharing, the result
+	 * gets a key of its own so a sequence going on from it never matches
+	 * anything else */
+	static std::atomic<uint64_t> serial(0);
+	double ratio = base_ratio;
+	uint64_t key = matteKeyMix((uintptr_t)priv, ++serial);
+
+	if (priv->shareResults) {
+		key = modelResultKey(priv, time, inputImg.rect, frame, roi, hash.get(), base_ratio, ratio);
+
+		MatteCacheEntryPtr e = modelShared(effect, time, outputImg, inputImg,
+			garbageImg, solidImg, frame, hash, key, base_ratio, ratio);
+		if (e)
+			return e;
+	}
+
+	/* Whatever may look this result up later needs the hash, it's done
+	 * while the model runs */
+	bool want_hash = priv->model.cache.getLimit() || priv->skipStatic || priv->shareResults;
+
+	ModelJobPtr job;
+	OfxRectI rect;
+
+	while (1)
+	{
+		job = std::make_shared<ModelJob>();
+
+		PlanarImage &src = job->src;
+		BackendForward &fwd = job->fwd;
+
+		/* OFX Image -> Planar RGB (padded to bucket size) */
+		int in_h = bucketSize(roi.y2 - roi.y1, priv->shapeBucketing);
+		int in_w = bucketSize(roi.x2 - roi.x1, priv->shapeBucketing);
+
+		if (!imageToPlanar(src, inputImg, roi, in_h, in_w))
+			throw NoImageEx();
+
+		/* Ratio for this frame, lowered if over the time budget */
+		ratio = modelBudgetRatio(priv, base_ratio, src.h, src.w);
+
+		/* Recurrent state, if we're continuing a sequence. When the
+		 * garbage matte, tracking or letterbox crop moves, it follows.
+		 * If the input resolution or the ratio changed, it's resampled
+		 * to the new geometry */
+		BackendStatePtr state;
+
+		rect = OfxRectI{ roi.x1, roi.y1, roi.x1 + src.w, roi.y1 + src.h };
+
+		bool use_rn = priv->model.cur.rn &&
+			timeContinues(priv, priv->model.cur.rn_time, time);
+
+		if (use_rn) {
+			if (roiEqual(rect, priv->model.cur.rn_rect) &&
+			    roiEqual(inputImg.rect, priv->model.cur.rn_input) &&
+			    (ratio == priv->model.cur.rn_downsample_ratio))
+				state = priv->model.cur.rn;
+			else
+				state = modelRemapState(*priv->model.backend, priv->model.cur,
+					rect, inputImg.rect, ratio);
+		}
+
+		/* Run the model */
+		fwd.src = &src;
+		fwd.downsample_ratio = ratio;
+		fwd.state = state;
+		fwd.want_fgr = (priv->outputType == OUTPUT_RGBA) && (priv->colorSource != COLOR_SRC_INPUT);
+		fwd.feature_reuse = priv->featureReuse;
+
+		auto t0 = std::chrono::steady_clock::now();
+
+		modelRun(effect, job, [&]() {
+			if (want_hash)
+				hash.get();
+		});
+
+		auto t1 = std::chrono::steady_clock::now();
+
+		modelBudgetUpdate(priv, std::chrono::duration<double, std::milli>(t1 - t0).count());
+
+		if (fwd.features_reused)
+			priv->model.encoder_skips++;
+
+		if (!priv->trackSubject)
+			break;
+
+		/* Find the subject for the next frame. If it was lost or may
+		 * extend beyond the crop, redo this frame on the full one */
+		bool found = roiAlphaBounds(priv->model.cur.track_bbox, fwd.pha, roi);
+
+		priv->model.cur.track_time = found ? time : nan("");
+
+		if (roiEqual(roi, frame)) {
+			priv->model.cur.track_frames = 0;
+			break;
+		}
+
+		if (found && !roiClipped(priv->model.cur.track_bbox, roi, frame))
+			break;
+
+		roi = frame;
+	}
+
+	/* Recursive states for next run */
+	priv->model.cur.rn_time = time;
+	priv->model.cur.rn_rect = rect;
+	priv->model.cur.rn_input = inputImg.rect;
+	priv->model.cur.rn_downsample_ratio = ratio;
+	priv->model.cur.rn = job->fwd.next_state;
+	priv->model.cur.rn_key = key;
+
+	/* An approximate result, so is everything that follows from it : that
+	 * sequence is now only ours */
+	if (job->fwd.features_reused)
+		priv->model.cur.rn_key = matteKeyMix(key, (uintptr_t)priv);
+
+	if (outputImg)
+		modelOutput(priv, *outputImg, inputImg, garbageImg, solidImg, roi,
+			&job->src, job->fwd.fgr, job->fwd.pha);
+
+	/* Result, cached unless it's a reduced one to hold the time budget */
+	auto entry = std::make_shared<MatteCacheEntry>();
+
+	entry->profile = priv->model.profile;
+	entry->scale = priv->model.scale;
+	entry->downsample_ratio = base_ratio;
+	entry->frame = frame;
+	entry->hash = want_hash ? hash.get() : 0;
+	entry->key = priv->model.cur.rn_key;
+	entry->roi = roi;
+	entry->rect = rect;
+	entry->input_rect = inputImg.rect;
+	entry->pha = std::move(job->fwd.pha);
+	entry->fgr = std::move(job->fwd.fgr);
+	entry->state = job->fwd.next_state;
+
+	if (priv->model.cache.getLimit() && (ratio == base_ratio))
+		priv->model.cache.insert(time, entry);
+
+	/* Others would have run the encoder, so that's not what they'd get */
+	if (priv->shareResults && !job->fwd.features_reused)
+		gSharedCache.insert(key, entry);
+
+	return entry;
+}
+
+static MatteCacheEntryPtr
+modelCached(OfxImageEffectHandle effect, OfxTime time,
+	const ImageInfo *outputImg, const ImageInfo &inputImg,
+	const ImageInfo *garbageImg, const ImageInfo *solidImg,
+	const OfxRectI &frame, InputHash &hash)
+{
+	InstanceData *priv = getInstanceData(effect);
+
+	MatteCacheEntryPtr e = priv->model.cache.findNear(time, TIME_EPSILON);
+
+	if (!e)
+		return e;
+
+	/* Must be from the same input and settings. A final render result is
+	 * fine for interactive playback too */
+	enum modelProfile profile = (enum modelProfile)e->profile;
+	bool want_fgr = (priv->outputType == OUTPUT_RGBA) && (priv->colorSource != COLOR_SRC_INPUT);
+
+	if (((profile != priv->model.profile) && (profile != PROFILE_FINAL)) ||
+	    (e->scale != priv->model.scale) ||
+	    (e->downsample_ratio != modelDownsampleRatio(priv, profile, e->scale)) ||
+	    !roiEqual(e->frame, frame) || (want_fgr && e->fgr.empty()) ||
+	    (e->hash != hash.get()))
+		return MatteCacheEntryPtr();
+
+	/* The sequence goes on from its state checkpoint, if it's from the
+	 * model in use */
+	if (profile == priv->model.profile) {
+		priv->model.cur.rn_time = time;
+		priv->model.cur.rn_rect = e->rect;
+		priv->model.cur.rn_input = e->input_rect;
+		priv->model.cur.rn_downsample_ratio = e->downsample_ratio;
+		priv->model.cur.rn = e->state;
+		priv->model.cur.rn_key = e->key;
 	} else {
-		return torch::Tensor();
+		cursorClear(priv->model.cur);
+	}
+
+	if (priv->trackSubject) {
+		bool found = roiAlphaBounds(priv->model.cur.track_bbox, e->pha, e->roi);
+		priv->model.cur.track_time = found ? time : nan("");
+		priv->model.cur.track_roi = e->roi;
 	}
 
-	p = ((uint8_t*)img.ptr) + img.rowBytes * img.rect.y1 + vs * img.rect.x1;
+	if (outputImg)
+		modelOutput(priv, *outputImg, inputImg, garbageImg, solidImg, e->roi,
+			NULL, e->fgr, e->pha);
+
+	return e;
+}
+
+/* Largest difference between two signatures */
+static double
+signatureDiff(const std::vector<float> &a, const std::vector<float> &b)
+{
+	double d = 0.0;
+
+	if (a.empty() || (a.size() != b.size()))
+		return INFINITY;
+
+	for (size_t i=0; i<a.size(); i++)
+		d = std::max(d, (double)fabsf(a[i] - b[i]));
+
+	return d;
+}
+
+static bool
+modelHeld(OfxImageEffectHandle effect, OfxTime time,
+	const ImageInfo *outputImg, const ImageInfo &inputImg,
+	const ImageInfo *garbageImg, const ImageInfo *solidImg,
+	const OfxRectI &frame, InputHash &hash, const std::vector<float> &sig)
+{
+	InstanceData *priv = getInstanceData(effect);
+	ModelCursor &cur = priv->model.cur;
+
+	MatteCacheEntryPtr e = cur.hold;
+
+	/* Last result of this sequence, still valid for the current settings */
+	if (!e || (cur.hold_gen != priv->model.cache.generation()) ||
+	    !timeContinues(priv, cur.hold_time, time))
+		return false;
+
+	enum modelProfile profile = (enum modelProfile)e->profile;
+	bool want_fgr = (priv->outputType == OUTPUT_RGBA) && (priv->colorSource != COLOR_SRC_INPUT);
+
+	if (((profile != priv->model.profile) && (profile != PROFILE_FINAL)) ||
+	    (e->scale != priv->model.scale) ||
+	    (e->downsample_ratio != modelDownsampleRatio(priv, profile, e->scale)) ||
+	    !roiEqual(e->frame, frame) ||
+	    (want_fgr && e->fgr.empty()))
+		return false;
 
-	torch::Tensor rv = torch::from_blob(
-		p,
-		{ h, w, nc },
-		{ img.rowBytes / vs, nc, 1 },
-		dt
-	);
+	/* And the input it was computed from didn't change (enough). That's
+	 * checked against that input, not the previous frame, so slow drifts
+	 * don't add up */
+	if ((e->hash != hash.get()) &&
+	    !((priv->staticThreshold > 0.0) && (signatureDiff(cur.hold_sig, sig) <= priv->staticThreshold)))
+		return false;
 
-	rv = rv.to(td, tt);
-	if (sf != 1.0f)
-		rv *= sf;
-	rv = rv.permute({2, 0, 1});
-	rv = rv.unsqueeze(0);
+	/* Nothing moved, the recurrent state (and the tracked subject) carry
+	 * over as-is to the next frame */
+	if (cur.rn && timeContinues(priv, cur.rn_time, time))
+		cur.rn_time = time;
 
-	return rv;
+	if (timeContinues(priv, cur.track_time, time))
+		cur.track_time = time;
+
+	cur.hold_time = time;
+
+	if (outputImg)
+		modelOutput(priv, *outputImg, inputImg, garbageImg, solidImg, e->roi,
+			NULL, e->fgr, e->pha);
+
+	return true;
 }
 
 static void
-tensorToImage(struct ImageInfo &img, torch::Tensor t)
+modelSkip(OfxImageEffectHandle effect, OfxTime time,
+	const ImageInfo *outputImg, const ImageInfo &inputImg,
+	const ImageInfo *garbageImg, const ImageInfo *solidImg,
+	const OfxRectI &roi)
 {
-	int w = img.rect.x2 - img.rect.x1;
-	int h = img.rect.y2 - img.rect.y1;
-	int nc, vs;
-	uint8_t *p_dst, *p_src;
-	torch::ScalarType dt;
-	torch::Device dev_cpu = torch::Device("cpu");
-	float sf = 1.0f;
-
-	if (!strcmp(img.components, kOfxImageComponentRGBA)) {
-		nc = 4;
-	} else if (!strcmp(img.components, kOfxImageComponentRGB )) {
-		nc = 3;
-	} else if (!strcmp(img.components, kOfxImageComponentAlpha)) {
-		nc = 1;
-	} else {
+	InstanceData *priv = getInstanceData(effect);
+
+	/* The mattes alone define the result. The subject isn't observed, so
+	 * the recurrent state is carried over as-is to the next frame rather
+	 * than restarting the sequence */
+	if (priv->model.cur.rn && timeContinues(priv, priv->model.cur.rn_time, time))
+		priv->model.cur.rn_time = time;
+
+	if (!outputImg)
+		return;
+
+	/* Color straight from the input */
+	bool rgba = (priv->outputType == OUTPUT_RGBA) && !roiEmpty(roi);
+	PlanarImage src;
+
+	if (rgba && !imageToPlanar(src, inputImg, roi, 0, 0))
+		throw NoImageEx();
+
+	if (!planarToImage(*outputImg, roi, src, PlanarImage(), garbageImg, solidImg,
+	                   rgba, priv->postmultiplyAlpha))
+		throw NoImageEx();
+}
+
+static void
+modelFrame(OfxImageEffectHandle effect, OfxTime time,
+	const ImageInfo *outputImg, const ImageInfo &inputImg,
+	ImageInfo &garbageImg, ImageInfo &solidImg)
+{
+	InstanceData *priv = getInstanceData(effect);
+
+	/* Letterbox / pillarbox : only the active picture area matters */
+	OfxRectI frame = inputImg.rect;
+
+	if (priv->skipBorders)
+		imageActiveBounds(frame, inputImg);
+
+	/* Garbage matte : only run the model on the area it covers */
+	OfxRectI roi = frame;
+
+	if (priv->hasGarbageMatte && !roiEmpty(frame) &&
+	    (fillImageInfos(garbageImg, effect, priv->garbageMatteClip, time) == kOfxStatOK))
+	{
+		OfxRectI bbox;
+
+		if (imageAlphaBounds(bbox, garbageImg) && !roiEmpty(bbox = roiIntersect(bbox, frame))) {
+			roiSelect(priv->model.cur.roi, bbox, frame);
+			roi = priv->model.cur.roi;
+		} else {
+			roi = OfxRectI{ 0, 0, 0, 0 };
+		}
+	}
+
+	/* Solid matte : merged in the output */
+	if (priv->hasSolidMatte)
+		fillImageInfos(solidImg, effect, priv->solidMatteClip, time);
+
+	const ImageInfo *garbage = garbageImg.h ? &garbageImg : NULL;
+	const ImageInfo *solid   = solidImg.h   ? &solidImg   : NULL;
+
+	/* Skip the model if the mattes already give the answer : nothing
+	 * to matte, or everything that's visible is forced opaque */
+	OfxRectI vis = outputImg ? roiIntersect(roi, outputImg->rect) : roi;
+
+	bool trivial = roiEmpty(vis) ||
+		(solid && imageAlphaCovers(*solid, vis));
+
+	if (trivial) {
+		modelSkip(effect, time, outputImg, inputImg, garbage, solid, vis);
 		return;
 	}
 
-	if (!strcmp(img.pixelDepth, kOfxBitDepthByte)) {
-		vs = 1;
-		dt = torch::kByte;
-		sf = 255.0f;
-	} else if (!strcmp(img.pixelDepth, kOfxBitDepthShort)) {
-		vs = 2;
-		dt = torch::kShort;
-		sf = 32768.0f;
-	} else if (!strcmp(img.pixelDepth, kOfxBitDepthHalf)) {
-		vs = 2;
-		dt = torch::kFloat16;
-	} else if (!strcmp(img.pixelDepth, kOfxBitDepthFloat)) {
-		vs = 4;
-		dt = torch::kFloat32;
-	} else {
+	/* Input content, to match known results */
+	unsigned gen = priv->model.cache.generation();
+	InputHash hash(inputImg, roi);
+	std::vector<float> sig;
+
+	if (priv->skipStatic && (priv->staticThreshold > 0.0))
+		imageSignature(sig, inputImg, roi);
+
+	/* Same as the last frame, known result, or run the model */
+	if (priv->skipStatic &&
+	    modelHeld(effect, time, outputImg, inputImg, garbage, solid, roi, hash, sig))
 		return;
+
+	MatteCacheEntryPtr e = modelCached(effect, time, outputImg, inputImg, garbage, solid, roi, hash);
+
+	if (!e)
+		e = modelRender(effect, time, outputImg, inputImg, garbage, solid, roi, hash);
+
+	if (priv->skipStatic) {
+		priv->model.cur.hold_time = time;
+		priv->model.cur.hold = e;
+		priv->model.cur.hold_sig = std::move(sig);
+		priv->model.cur.hold_gen = gen;
 	}
+}
 
-	t = t.squeeze(0);
-	t = t.permute({1, 2, 0});
-	if (sf != 1.0f)
-		t *= sf;
-	t = t.to(dev_cpu, dt);
-	t = t.contiguous();
+/* Model for a frame without any output, to get the state and cache ahead */
+static void
+modelFrameAhead(OfxImageEffectHandle effect, OfxTime time)
+{
+	InstanceData *priv = getInstanceData(effect);
 
-	p_src = (uint8_t*) t.data_ptr<float>();
-	p_dst = ((uint8_t*)img.ptr) + img.rowBytes * img.rect.y1 + vs * img.rect.x1;
+	ImageInfo inputImg   = ImageInfo();
+	ImageInfo garbageImg = ImageInfo();
+	ImageInfo solidImg   = ImageInfo();
 
-	for (int y=0; y<h; y++) {
-		memcpy(p_dst, p_src, w*nc*vs);
-		p_src += vs * t.strides()[0];
-		p_dst += img.rowBytes;
+	try {
+		if (fillImageInfos(inputImg, effect, priv->inputClip, time) != kOfxStatOK)
+			throw NoImageEx();
+
+		modelFrame(effect, time, NULL, inputImg, garbageImg, solidImg);
+	} catch (...) {
+		if (inputImg.h)
+			gEffectHost->clipReleaseImage(inputImg.h);
+		if (garbageImg.h)
+			gEffectHost->clipReleaseImage(garbageImg.h);
+		if (solidImg.h)
+			gEffectHost->clipReleaseImage(solidImg.h);
+		throw;
 	}
+
+	if (inputImg.h)
+		gEffectHost->clipReleaseImage(inputImg.h);
+	if (garbageImg.h)
+		gEffectHost->clipReleaseImage(garbageImg.h);
+	if (solidImg.h)
+		gEffectHost->clipReleaseImage(solidImg.h);
+}
+
+/* Reverse playback : the frames before are computed as a block, forward
+ * from a cached one (or a cold start that many frames back), so the next
+ * ones requested are cache hits and there's one cold start per block at
+ * most instead of one per frame. The block is on the times the playback
+ * steps through, going back from the requested one */
+#define REVERSE_BLOCK	16
+
+static void
+modelReverse(OfxImageEffectHandle effect, OfxTime time, double step)
+{
+	InstanceData *priv = getInstanceData(effect);
+
+	if (!priv->model.cache.getLimit() || priv->model.cache.findNear(time, TIME_EPSILON))
+		return;
+
+	/* Block start, or the last cached frame before. Not before the clip */
+	OfxRangeD range;
+	OfxPropertySetHandle clipProps;
+	int n = REVERSE_BLOCK;
+
+	gEffectHost->clipGetPropertySet(priv->inputClip, &clipProps);
+
+	if (gPropHost->propGetDoubleN(clipProps, kOfxImageEffectPropFrameRange, 2, &range.min) == kOfxStatOK)
+		while ((n > 0) && ((time - n * step) < (range.min - TIME_EPSILON)))
+			n--;
+
+	for (int i=1; i<=n; i++) {
+		if (priv->model.cache.findNear(time - i * step, TIME_EPSILON)) {
+			n = i;
+			break;
+		}
+	}
+
+	try {
+		for (int i=n; i>0; i--)
+			modelFrameAhead(effect, time - i * step);
+	} catch (NoImageEx &) {
+		/* Host won't give other frames, render this one alone */
+		cursorClear(priv->model.cur);
+	}
+}
+
+/* Precompute : OpenFX only gives images from within an action, so the whole
+ * walk runs in the button's instance changed action, blocking the host UI
+ * until done or cancelled from the progress bar */
+static void
+modelPrecompute(OfxImageEffectHandle effect, OfxPropertySetHandle inArgs)
+{
+	InstanceData *priv = getInstanceData(effect);
+
+	if (!priv->model.cache.getLimit())
+		return;
+
+	/* Whole input clip, at the scale of the action */
+	OfxRangeD range;
+	OfxPointD scale = { 1.0, 1.0 };
+	OfxPropertySetHandle clipProps;
+
+	gEffectHost->clipGetPropertySet(priv->inputClip, &clipProps);
+
+	if (gPropHost->propGetDoubleN(clipProps, kOfxImageEffectPropFrameRange, 2, &range.min) != kOfxStatOK)
+		return;
+
+	gPropHost->propGetDoubleN(inArgs, kOfxImageEffectPropRenderScale, 2, &scale.x);
+
+	if (gProgressHost)
+		gProgressHost->progressStart(effect, "Precomputing matte");
+
+	/* It has its own sequence, rendered as a final render would */
+	ModelCursor cursor;
+
+	cursor.profile = PROFILE_FINAL;
+	cursor.scale = std::max(scale.x, scale.y);
+
+	OfxTime time = range.min;
+
+	while (time <= range.max)
+	{
+		double progress = (time - range.min) / (range.max - range.min + 1.0);
+
+		if (gProgressHost && (gProgressHost->progressUpdate(effect, progress) == kOfxStatReplyNo))
+			break;
+
+		auto lock = modelLock(priv);
+
+		modelWaitIdle(priv);
+
+		if (modelSetup(effect) != kOfxStatOK)
+			break;
+
+		enum modelProfile fg_profile = priv->model.profile;
+		double fg_scale = priv->model.scale;
+		bool fg_interactive = priv->interactive;
+
+		std::swap(priv->model.cur, cursor);
+		priv->model.profile = PROFILE_FINAL;
+		priv->model.backend = priv->model.profiles[PROFILE_FINAL].backend.get();
+		priv->model.scale = priv->model.cur.scale;
+		priv->interactive = false;
+
+		bool stop = false;
+
+		try {
+			modelFrameAhead(effect, time);
+		} catch(NoImageEx &) {
+			/* Gap in the clip, restart the sequence after it */
+			cursorClear(priv->model.cur);
+		} catch(AbortEx &) {
+			/* Host asked to stop */
+			stop = true;
+		} catch (const std::exception& e) {
+			std::cerr << "[!] OFX Plugin error: Exception caught while precomputing: " << e.what() << std::endl;
+			stop = true;
+		}
+
+		priv->interactive = fg_interactive;
+		priv->model.scale = fg_scale;
+		priv->model.profile = fg_profile;
+		priv->model.backend = priv->model.profiles[fg_profile].backend.get();
+		std::swap(priv->model.cur, cursor);
+
+		if (stop)
+			break;
+
+		time += 1.0;
+	}
+
+	if (gProgressHost)
+		gProgressHost->progressEnd(effect);
 }
 
 
@@ -900,24 +2391,43 @@ effectRender(
 
 	OfxTime time;
 	OfxRectI renderWindow;
+	OfxPointD scale;
 	OfxStatus status = kOfxStatOK;
 
-	/* Target time and window */
+	/* Target time, window and scale */
 	gPropHost->propGetDouble(inArgs, kOfxPropTime, 0, &time);
 	gPropHost->propGetIntN(inArgs, kOfxImageEffectPropRenderWindow, 4, &renderWindow.x1);
+	gPropHost->propGetDoubleN(inArgs, kOfxImageEffectPropRenderScale, 2, &scale.x);
+
+	/* Prepare the model for this kind of render (if the host says) */
+	int interactive_status;
+
+	auto lock = modelLock(priv);
+
+	if (gPropHost->propGetInt(inArgs, kOfxImageEffectPropInteractiveRenderStatus, 0, &interactive_status) == kOfxStatOK)
+		priv->interactive = interactive_status;
+
+	modelWaitIdle(priv);
 
-	/* Prepare the model */
 	status = modelSetup(effect);
 	if (status != kOfxStatOK)
 		return status;
 
+	modelSelect(effect, priv->interactive);
+
+	/* Sequence this frame belongs to. Its state and crops are in the
+	 * canvas coordinates of its render scale */
+	priv->model.scale = std::max(scale.x, scale.y);
+
+	double reverse = modelSelectCursor(priv, time);
+
 	/* */
-	ImageInfo outputImg;
-	ImageInfo inputImg;
+	ImageInfo outputImg = ImageInfo();
+	ImageInfo inputImg  = ImageInfo();
+	ImageInfo garbageImg = ImageInfo();
+	ImageInfo solidImg   = ImageInfo();
 
 	try {
-		torch::NoGradGuard no_grad_guard;
-
 		/* Get images */
 		if (fillImageInfos(outputImg, effect, priv->outputClip, time) != kOfxStatOK)
 			throw NoImageEx();
@@ -930,116 +2440,21 @@ effectRender(
 		printf("I: %d %d %d %d %s %s\n", inputImg.rect.x1, inputImg.rect.x2, inputImg.rect.y1, inputImg.rect.y2, inputImg.pixelDepth, inputImg.components);
 #endif
 
-		/* OFX Image -> Input tensor */
-		auto inputTensor = imageToTensor(inputImg, priv->torch.device, priv->torch.type);
-		if (!inputTensor.defined())
-			throw NoImageEx();
+		if (reverse > 0.0)
+			modelReverse(effect, time, reverse);
 
-		switch (inputTensor.sizes()[1])
-		{
-		case 3: /* RGB already, nothing to do */
-			break;
-
-		case 4: /* RGBA, drop alpha */
-			inputTensor = inputTensor.narrow(1,0,3);
-			break;
-
-		default: /* Other ? Can't deal with that */
-			throw NoImageEx();
-		}
-
-		/* Run the model */
-		torch::jit::Kwargs kwargs;
-		c10::List<torch::Tensor> outputs;
-
-		if (priv->downsampleRatio != 0.0) {
-			kwargs.insert({"downsample_ratio", priv->downsampleRatio});
-		}
-
-		if (priv->torch.rn[0].defined() && (
-			(time == (priv->torch.rn_time + 1.0)) ||
-			(time ==  priv->torch.rn_time)
-		)) {
-			/* We have usable recursive states */
-			outputs = priv->torch.model.forward({
-				inputTensor,
-				priv->torch.rn[0],
-				priv->torch.rn[1],
-				priv->torch.rn[2],
-				priv->torch.rn[3]
-			}, kwargs).toTensorList();
-		}
-		else
-		{
-			/* First of a sequence of run */
-			outputs = priv->torch.model.forward({
-				inputTensor
-			}, kwargs).toTensorList();
-		}
-
-		/* Recursive states for next run */
-		priv->torch.rn_time = time;
-
-		priv->torch.rn[0] = outputs.get(2);
-		priv->torch.rn[1] = outputs.get(3);
-		priv->torch.rn[2] = outputs.get(4);
-		priv->torch.rn[3] = outputs.get(5);
-
-		/* Tensor outputs */
-		auto fgr = outputs.get(0);
-		auto pha = outputs.get(1);
-
-		/* Post process of output tensor depending on options */
-		torch::Tensor outputTensor;
-
-		switch (priv->outputType)
-		{
-		case OUTPUT_RGBA:
-			/* Select foreground */
-			if (priv->colorSource == COLOR_SRC_INPUT)
-				fgr = inputTensor;
-
-			/* Post Multiply ? */
-			if (priv->postmultiplyAlpha) {
-				fgr *= pha.repeat({1, 3, 1, 1});
-			}
-
-			/* Combine */
-			outputTensor = torch::cat({fgr, pha}, 1);
-
-			break;
-
-		case OUTPUT_ALPHA:
-			/* Repeat the alpha as needed by output components */
-			if (!strcmp(outputImg.components, kOfxImageComponentRGBA)) {
-				outputTensor = pha.repeat({1, 4, 1, 1});
-			} else if (!strcmp(outputImg.components, kOfxImageComponentRGB )) {
-				outputTensor = pha.repeat({1, 3, 1, 1});
-			} else if (!strcmp(outputImg.components, kOfxImageComponentAlpha)) {
-				outputTensor = pha;
-			} else {
-				throw NoImageEx();
-			}
-			break;
-
-		default:
-			throw NoImageEx();
-		}
-
-		/* Output tensor -> OFX Image */
-		tensorToImage(outputImg, outputTensor);
-
-#if 0
-		std::cout << "tensor dtype   = " << inputTensor.dtype()   << std::endl;
-		std::cout << "tensor size    = " << inputTensor.sizes()   << std::endl;
-		std::cout << "tensor strides = " << inputTensor.strides() << std::endl;
-#endif
+		modelFrame(effect, time, &outputImg, inputImg, garbageImg, solidImg);
 
 	} catch(NoImageEx &) {
 		/* Missing a required clip, so abort */
 		if(!gEffectHost->abort(effect)) {
 			status = kOfxStatFailed;
 		}
+	} catch(AbortEx &) {
+		/* Host gave up on this frame, state is untouched */
+	} catch (const std::exception& e) {
+		std::cerr << "[!] OFX Plugin error: Exception caught while rendering: " << e.what() << std::endl;
+		status = kOfxStatFailed;
 	}
 
 	/* Cleanup */
@@ -1047,6 +2462,10 @@ effectRender(
 		gEffectHost->clipReleaseImage(outputImg.h);
 	if (inputImg.h)
 		gEffectHost->clipReleaseImage(inputImg.h);
+	if (garbageImg.h)
+		gEffectHost->clipReleaseImage(garbageImg.h);
+	if (solidImg.h)
+		gEffectHost->clipReleaseImage(solidImg.h);
 
 	return status;
 }
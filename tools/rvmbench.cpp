@@ -0,0 +1,361 @@
+/*
+ * rvmbench.cpp
+ *
+ * vim: ts=8 sw=8
+ *
+ * Benchmark of the inference backends, running each of the given models
+ * on the same frames with their recurrent states and comparing their
+ * outputs to the first one.
+ *
+ * Copyright (c) 2022-2023 Sylvain Munaut <tnt@246tNt.com>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "backend.h"
+
+
+struct ModelSpec {
+	const char *name;
+	enum backendType type;
+	const char *file;
+};
+
+struct Options {
+	std::vector<ModelSpec> models;
+	enum backendDevice device;
+	enum backendPrecision precision;
+	double downsample_ratio;
+	int width, height;
+	int frames;
+	int warmup;
+	bool alpha_only;
+	double feature_reuse;
+	std::vector<const char *> images;
+
+	Options() :
+		device(BACKEND_DEVICE_CPU),
+		precision(BACKEND_PRECISION_FLOAT32),
+		downsample_ratio(0.0),
+		width(1920), height(1080),
+		frames(50), warmup(5),
+		alpha_only(false), feature_reuse(0.0) {};
+};
+
+static const struct {
+	const char *name;
+	enum backendType type;
+} backendNames[] = {
+	{ "torchscript", BACKEND_TORCHSCRIPT },
+	{ "aot",         BACKEND_TORCH_AOT },
+	{ "onnx",        BACKEND_ONNXRUNTIME },
+	{ "native",      BACKEND_NATIVE },
+	{ NULL }
+};
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] -m TYPE:FILE [-m TYPE:FILE ...] [frame.ppm ...]\n", argv0);
+	fprintf(stderr, "  -m TYPE:FILE  Model to run, TYPE is one of :");
+	for (int i=0; backendNames[i].name; i++)
+		fprintf(stderr, " %s%s", backendNames[i].name, backendAvailable(backendNames[i].type) ? "" : "(n/a)");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "                The first model is the reference for output comparison\n");
+	fprintf(stderr, "  -d DEV        Device: cpu (default) or cuda\n");
+	fprintf(stderr, "  -p 16|32      Precision (default 32)\n");
+	fprintf(stderr, "  -r RATIO      Downsample ratio (default 0.0, the reference model default, used for all)\n");
+	fprintf(stderr, "  -s WxH        Synthetic frame size when no frames given (default 1920x1080)\n");
+	fprintf(stderr, "  -n N          Number of frames to run (default 50, frames are looped)\n");
+	fprintf(stderr, "  -w N          Number of warm-up frames (default 5)\n");
+	fprintf(stderr, "  -a            Alpha only (don't request the foreground output)\n");
+	fprintf(stderr, "  -e CHANGE     Reuse the encoder pass while the input changed less than that (default 0.0, off)\n");
+}
+
+static bool
+parseModel(ModelSpec &spec, const char *arg)
+{
+	const char *sep = strchr(arg, ':');
+
+	if (!sep)
+		return false;
+
+	for (int i=0; backendNames[i].name; i++) {
+		if ((strlen(backendNames[i].name) == (size_t)(sep - arg)) &&
+		    !strncmp(backendNames[i].name, arg, sep - arg)) {
+			spec.name = backendNames[i].name;
+			spec.type = backendNames[i].type;
+			spec.file = sep + 1;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Frames                                                                    */
+/* ------------------------------------------------------------------------- */
+
+static PlanarImage
+loadPPM(const char *filename)
+{
+	FILE *fh = fopen(filename, "rb");
+	int w, h, maxval;
+
+	if (!fh)
+		throw std::runtime_error(std::string("Unable to open ") + filename);
+
+	if ((fscanf(fh, "P6 %d %d %d", &w, &h, &maxval) != 3) || (maxval != 255) || (fgetc(fh) == EOF)) {
+		fclose(fh);
+		throw std::runtime_error(std::string("Unsupported PPM file ") + filename);
+	}
+
+	std::vector<uint8_t> pix((size_t)w * h * 3);
+	size_t n = fread(pix.data(), 1, pix.size(), fh);
+	fclose(fh);
+
+	if (n != pix.size())
+		throw std::runtime_error(std::string("Truncated PPM file ") + filename);
+
+	PlanarImage img(3, h, w);
+
+	for (int c=0; c<3; c++)
+		for (size_t i=0; i<(size_t)w*h; i++)
+			img.plane(c)[i] = pix[i*3+c] / 255.0f;
+
+	return img;
+}
+
+static std::vector<PlanarImage>
+loadFrames(const Options &opt)
+{
+	std::vector<PlanarImage> frames;
+
+	for (const char *f : opt.images)
+		frames.push_back(loadPPM(f));
+
+	/* Synthetic moving gradient if nothing was given */
+	if (frames.empty()) {
+		for (int i=0; i<8; i++) {
+			PlanarImage img(3, opt.height, opt.width);
+			float p = i / 8.0f;
+
+			for (int y=0; y<opt.height; y++) {
+				for (int x=0; x<opt.width; x++) {
+					float fx = (float)x / opt.width;
+					float fy = (float)y / opt.height;
+					size_t o = (size_t)y * opt.width + x;
+					img.plane(0)[o] = fmodf(fx + p, 1.0f);
+					img.plane(1)[o] = fmodf(fy + p, 1.0f);
+					img.plane(2)[o] = (fx + fy) * 0.5f;
+				}
+			}
+
+			frames.push_back(img);
+		}
+	}
+
+	return frames;
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Benchmark                                                                 */
+/* ------------------------------------------------------------------------- */
+
+struct Result {
+	std::vector<double> times_ms;
+	std::vector<PlanarImage> pha;
+	int reused = 0;
+};
+
+static Result
+runSequence(Backend &be, const Options &opt, const std::vector<PlanarImage> &frames)
+{
+	Result res;
+	BackendStatePtr state;
+
+	for (int i=0; i<(opt.warmup + opt.frames); i++)
+	{
+		BackendForward fwd;
+
+		fwd.src = &frames[i % frames.size()];
+		fwd.downsample_ratio = opt.downsample_ratio;
+		fwd.state = state;
+		fwd.want_fgr = !opt.alpha_only;
+		fwd.feature_reuse = opt.feature_reuse;
+
+		auto t0 = std::chrono::steady_clock::now();
+		be.forward(fwd);
+		auto t1 = std::chrono::steady_clock::now();
+
+		state = fwd.next_state;
+
+		if (i >= opt.warmup) {
+			res.times_ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+			res.pha.push_back(std::move(fwd.pha));
+			res.reused += fwd.features_reused;
+		}
+	}
+
+	return res;
+}
+
+static void
+printStats(const char *name, std::vector<double> t)
+{
+	double sum = 0.0;
+
+	std::sort(t.begin(), t.end());
+	for (double v : t)
+		sum += v;
+
+	printf("%-12s mean %8.2f ms   median %8.2f ms   min %8.2f ms   max %8.2f ms   (%.2f fps)\n",
+		name,
+		sum / t.size(),
+		t[t.size() / 2],
+		t.front(),
+		t.back(),
+		1000.0 * t.size() / sum
+	);
+}
+
+static void
+printDiff(const Result &ref, const Result &res)
+{
+	double max_err = 0.0, sum_err = 0.0;
+	size_t n = 0;
+
+	for (size_t i=0; i<ref.pha.size(); i++) {
+		const PlanarImage &a = ref.pha[i];
+		const PlanarImage &b = res.pha[i];
+
+		if (a.data.size() != b.data.size())
+			throw std::runtime_error("Output size mismatch");
+
+		for (size_t j=0; j<a.data.size(); j++) {
+			double d = fabs(a.data[j] - b.data[j]);
+			max_err = std::max(max_err, d);
+			sum_err += d;
+		}
+
+		n += a.data.size();
+	}
+
+	printf("%-12s alpha difference to reference: max %.6f  mean %.6f\n", "", max_err, sum_err / n);
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* Main                                                                      */
+/* ------------------------------------------------------------------------- */
+
+int main(int argc, char *argv[])
+{
+	Options opt;
+	ModelSpec spec;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:d:p:r:s:n:w:ae:h")) != -1) {
+		switch (c) {
+		case 'm':
+			if (!parseModel(spec, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			opt.models.push_back(spec);
+			break;
+		case 'd':
+			opt.device = strcmp(optarg, "cuda") ? BACKEND_DEVICE_CPU : BACKEND_DEVICE_CUDA;
+			break;
+		case 'p':
+			opt.precision = (atoi(optarg) == 16) ? BACKEND_PRECISION_FLOAT16 : BACKEND_PRECISION_FLOAT32;
+			break;
+		case 'r': opt.downsample_ratio = atof(optarg); break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &opt.width, &opt.height) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n': opt.frames = atoi(optarg); break;
+		case 'w': opt.warmup = atoi(optarg); break;
+		case 'a': opt.alpha_only = true; break;
+		case 'e': opt.feature_reuse = atof(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	for (int i=optind; i<argc; i++)
+		opt.images.push_back(argv[i]);
+
+	if (opt.models.empty() || (opt.frames <= 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	try {
+		auto frames = loadFrames(opt);
+		Result ref;
+
+		printf("%d frames of %dx%d, %d warm-up\n",
+			opt.frames, frames[0].w, frames[0].h, opt.warmup);
+
+		for (size_t i=0; i<opt.models.size(); i++)
+		{
+			BackendConfig cfg;
+
+			cfg.model_file = opt.models[i].file;
+			cfg.device     = opt.device;
+			cfg.precision  = opt.precision;
+
+			std::unique_ptr<Backend> be(backendCreate(opt.models[i].type, cfg));
+
+			/* Backends have different defaults, compare them all at
+			 * the one the reference resolves to */
+			if (opt.downsample_ratio == 0.0) {
+				opt.downsample_ratio = be->downsampleRatio(frames[0].h, frames[0].w, 0.0);
+				printf("downsample ratio %.4f\n", opt.downsample_ratio);
+			}
+
+			double ratio = be->downsampleRatio(frames[0].h, frames[0].w, opt.downsample_ratio);
+
+			Result res = runSequence(*be, opt, frames);
+
+			printStats(opt.models[i].name, res.times_ms);
+
+			if (ratio != opt.downsample_ratio)
+				printf("%-12s ran at its fixed downsample ratio of %.4f\n", "", ratio);
+
+			if (opt.feature_reuse > 0.0)
+				printf("%-12s encoder pass reused on %d of %d frames\n", "", res.reused, opt.frames);
+
+			if (i == 0)
+				ref = std::move(res);
+			else
+				printDiff(ref, res);
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "[!] Error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}